@@ -0,0 +1,563 @@
+/*
+Microbenchmarks for the storage engine core.
+
+Every benchmark is run with an increasing iteration count until a run takes
+at least --min-time milliseconds, then the best of --repetitions runs is
+reported. Results are printed one JSON object per line so they can be
+diffed or loaded into a spreadsheet:
+
+  {"benchmark":"leaf_node_find","rows":13,"iterations":...,"ns_per_op":...}
+
+Usage: microbench [--filter substring] [--min-time ms] [--repetitions n]
+*/
+#define NOTTOSQL_NO_MAIN
+#include "../db.c"
+
+typedef struct {
+  Table* table;
+  char filename[64];
+  uint32_t rows;
+  uint32_t* keys;  // rows keys in insertion order
+  uint64_t rng;
+} BenchContext;
+
+/* Runs `iterations` operations and returns the nanoseconds spent on them */
+typedef uint64_t (*BenchFunction)(BenchContext* context, uint64_t iterations);
+
+typedef struct {
+  const char* name;
+  BenchFunction run;
+  bool needs_table;
+} Benchmark;
+
+const char* bench_filter = NULL;
+uint64_t bench_min_time_ns = 200 * 1000000ULL;
+uint32_t bench_repetitions = 3;
+
+uint64_t bench_random(BenchContext* context) {
+  /* xorshift64*, good enough and identical across runs */
+  context->rng ^= context->rng >> 12;
+  context->rng ^= context->rng << 25;
+  context->rng ^= context->rng >> 27;
+  return context->rng * 2685821657736338717ULL;
+}
+
+void bench_row(Row* row, uint32_t id) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%d", id);
+  snprintf(row->email, sizeof(row->email), "person%d@example.com", id);
+}
+
+void bench_open_table(BenchContext* context) {
+  strcpy(context->filename, "/tmp/nottosql-bench-XXXXXX");
+  int fd = mkstemp(context->filename);
+  if (fd == -1) {
+    printf("Unable to create benchmark file\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  context->table = db_open(context->filename);
+}
+
+void bench_close_table(BenchContext* context) {
+  char hot_pages_path[sizeof(context->filename) + sizeof("-hot")];
+  sprintf(hot_pages_path, "%s-hot", context->filename);
+  db_close(context->table);
+  unlink(context->filename);
+  unlink(hot_pages_path);
+  context->table = NULL;
+}
+
+/* Builds a table of context->rows rows, inserted in a shuffled order */
+void bench_build_table(BenchContext* context) {
+  bench_open_table(context);
+  context->keys = malloc(sizeof(uint32_t) * context->rows);
+  for (uint32_t i = 0; i < context->rows; i++) {
+    context->keys[i] = i + 1;
+  }
+  for (uint32_t i = context->rows; i > 1; i--) {
+    uint32_t j = bench_random(context) % i;
+    uint32_t tmp = context->keys[i - 1];
+    context->keys[i - 1] = context->keys[j];
+    context->keys[j] = tmp;
+  }
+
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  for (uint32_t i = 0; i < context->rows; i++) {
+    bench_row(&statement.row_to_insert, context->keys[i]);
+    execute_insert(&statement, context->table);
+  }
+}
+
+/*
+ * Writes every cached tree page back and drops it, so the next access misses.
+ * The header page stays resident, as it does in the engine.
+ */
+void bench_evict_all(Pager* pager) {
+  for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++) {
+    if (pager->pages[i] == NULL) {
+      continue;
+    }
+    pager_flush(pager, i);
+    free(pager->pages[i]);
+    pager->pages[i] = NULL;
+  }
+}
+
+uint64_t bench_leaf_node_find(BenchContext* context, uint64_t iterations) {
+  void* node = malloc(PAGE_SIZE);
+  initialize_leaf_node(node);
+  Row row;
+  for (uint32_t i = 0; i < LEAF_NODE_MAX_CELLS; i++) {
+    bench_row(&row, i * 2);
+    *leaf_node_key(node, i) = row.id;
+    serialize_row(&row, leaf_node_value(node, i));
+  }
+  *leaf_node_num_cells(node) = LEAF_NODE_MAX_CELLS;
+
+  /* A detached table whose only page is the leaf above */
+  Pager pager;
+  memset(&pager, 0, sizeof(Pager));
+  pager.pages[0] = node;
+  pager.num_pages = 1;
+  Table table;
+  memset(&table, 0, sizeof(Table));
+  table.pager = &pager;
+
+  uint64_t sink = 0;
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint32_t key = bench_random(context) % (LEAF_NODE_MAX_CELLS * 2);
+    Cursor* cursor = leaf_node_find(&table, 0, key);
+    sink += cursor->cell_num;
+    free(cursor);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+
+  free(node);
+  context->rng += sink;
+  return elapsed;
+}
+
+uint64_t bench_internal_node_find_child(BenchContext* context,
+                                        uint64_t iterations) {
+  void* node = malloc(PAGE_SIZE);
+  initialize_internal_node(node);
+  for (uint32_t i = 0; i < INTERNAL_NODE_MAX_KEYS; i++) {
+    *internal_node_cell(node, i) = i + 1;
+    *internal_node_key(node, i) = (i + 1) * 100;
+  }
+  *internal_node_num_keys(node) = INTERNAL_NODE_MAX_KEYS;
+  *internal_node_right_child(node) = INTERNAL_NODE_MAX_KEYS + 1;
+
+  uint64_t sink = 0;
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint32_t key = bench_random(context) % ((INTERNAL_NODE_MAX_KEYS + 1) * 100);
+    sink += internal_node_find_child(node, key);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+
+  free(node);
+  context->rng += sink;
+  return elapsed;
+}
+
+uint64_t bench_leaf_node_insert(BenchContext* context, uint64_t iterations) {
+  void* node = malloc(PAGE_SIZE);
+  initialize_leaf_node(node);
+  Pager pager;
+  memset(&pager, 0, sizeof(Pager));
+  pager.pages[0] = node;
+  pager.num_pages = 1;
+  Table table;
+  memset(&table, 0, sizeof(Table));
+  table.pager = &pager;
+
+  Row row;
+  bench_row(&row, 0);
+  Cursor cursor;
+  cursor.table = &table;
+  cursor.page_num = 0;
+  cursor.end_of_table = false;
+
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells == LEAF_NODE_MAX_CELLS) {
+      /* Never split, empty the leaf instead */
+      *leaf_node_num_cells(node) = 0;
+      num_cells = 0;
+    }
+    /* Insert at a random slot so cells get shifted like real inserts */
+    cursor.cell_num = bench_random(context) % (num_cells + 1);
+    row.id = cursor.cell_num;
+    leaf_node_insert(&cursor, row.id, &row);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+
+  free(node);
+  return elapsed;
+}
+
+/* Each iteration fills a root leaf and times the insert that splits it */
+uint64_t bench_leaf_split(BenchContext* context, uint64_t iterations) {
+  uint64_t elapsed = 0;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  for (uint64_t i = 0; i < iterations; i++) {
+    bench_open_table(context);
+    for (uint32_t j = 0; j < LEAF_NODE_MAX_CELLS; j++) {
+      bench_row(&statement.row_to_insert, j * 2);
+      execute_insert(&statement, context->table);
+    }
+    bench_row(&statement.row_to_insert, LEAF_NODE_MAX_CELLS);
+
+    uint64_t start = monotonic_ns();
+    execute_insert(&statement, context->table);
+    elapsed += monotonic_ns() - start;
+
+    bench_close_table(context);
+  }
+  return elapsed;
+}
+
+/* Sequential inserts into a growing tree, including internal node splits */
+uint64_t bench_insert_sequential(BenchContext* context, uint64_t iterations) {
+  uint64_t elapsed = 0;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  for (uint64_t done = 0; done < iterations;) {
+    bench_open_table(context);
+    uint64_t batch = iterations - done;
+    if (batch > context->rows) {
+      batch = context->rows;
+    }
+    uint64_t start = monotonic_ns();
+    for (uint32_t j = 0; j < batch; j++) {
+      bench_row(&statement.row_to_insert, j);
+      execute_insert(&statement, context->table);
+    }
+    elapsed += monotonic_ns() - start;
+    done += batch;
+    bench_close_table(context);
+  }
+  return elapsed;
+}
+
+uint64_t bench_get_page_hit(BenchContext* context, uint64_t iterations) {
+  Pager* pager = context->table->pager;
+  uint64_t sink = 0;
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint32_t page_num = bench_random(context) % pager->num_pages;
+    sink += (uintptr_t)get_page(pager, page_num);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  context->rng += sink;
+  return elapsed;
+}
+
+uint64_t bench_get_page_miss(BenchContext* context, uint64_t iterations) {
+  Pager* pager = context->table->pager;
+  uint64_t elapsed = 0;
+  for (uint64_t done = 0; done < iterations;) {
+    bench_evict_all(pager);
+    uint32_t num_pages = pager->num_pages;
+    uint64_t start = monotonic_ns();
+    for (uint32_t i = 0; i < num_pages && done < iterations; i++, done++) {
+      get_page(pager, i);
+    }
+    elapsed += monotonic_ns() - start;
+  }
+  return elapsed;
+}
+
+uint64_t bench_serialize_row(BenchContext* context, uint64_t iterations) {
+  Row row;
+  bench_row(&row, 42);
+  char destination[ROW_SIZE];
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    row.id = i;
+    serialize_row(&row, destination);
+    __asm__ volatile("" : : "r"(destination) : "memory");
+  }
+  return monotonic_ns() - start;
+}
+
+uint64_t bench_deserialize_row(BenchContext* context, uint64_t iterations) {
+  Row row;
+  bench_row(&row, 42);
+  char source[ROW_SIZE];
+  serialize_row(&row, source);
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    deserialize_row(source, &row);
+    __asm__ volatile("" : : "r"(&row) : "memory");
+  }
+  return monotonic_ns() - start;
+}
+
+/* One operation is one page checksummed, as on every flush and read miss */
+uint64_t bench_page_checksum(BenchContext* context, uint64_t iterations) {
+  uint8_t* page = malloc(PAGE_SIZE);
+  for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+    page[i] = bench_random(context);
+  }
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    page[0] = i;
+    update_page_checksum(page);
+    __asm__ volatile("" : : "r"(page) : "memory");
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  free(page);
+  return elapsed;
+}
+
+/* One operation is one row visited by a table_start/cursor_advance scan */
+uint64_t bench_full_scan(BenchContext* context, uint64_t iterations) {
+  Row row;
+  uint64_t elapsed = 0;
+  for (uint64_t done = 0; done < iterations;) {
+    uint64_t start = monotonic_ns();
+    Cursor* cursor = table_start(context->table);
+    while (!(cursor->end_of_table)) {
+      deserialize_row(cursor_value(cursor), &row);
+      cursor_advance(cursor);
+      done++;
+    }
+    free(cursor);
+    elapsed += monotonic_ns() - start;
+  }
+  return elapsed;
+}
+
+/* One operation is one table_get_row of a random existing id */
+uint64_t bench_point_lookup(BenchContext* context, uint64_t iterations) {
+  Row row;
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint32_t key = context->keys[bench_random(context) % context->rows];
+    table_get_row(context->table, key, &row);
+    __asm__ volatile("" : : "r"(&row) : "memory");
+  }
+  return monotonic_ns() - start;
+}
+
+/* The same, with a row cache holding every row */
+uint64_t bench_point_lookup_cached(BenchContext* context,
+                                   uint64_t iterations) {
+  context->table->row_cache = row_cache_new(context->rows);
+  uint64_t elapsed = bench_point_lookup(context, iterations);
+  row_cache_free(context->table->row_cache);
+  context->table->row_cache = NULL;
+  return elapsed;
+}
+
+/* Exits unless every batched answer matches a plain table_get_row */
+void bench_check_rows(Table* table, uint32_t* keys, uint32_t count, Row* rows,
+                      bool* found) {
+  for (uint32_t i = 0; i < count; i++) {
+    Row row;
+    bool expected = table_get_row(table, keys[i], &row);
+    if (found[i] != expected ||
+        (expected && (rows[i].id != row.id ||
+                      strcmp(rows[i].username, row.username) != 0 ||
+                      strcmp(rows[i].email, row.email) != 0))) {
+      printf("table_get_rows disagrees with table_get_row on id %d.\n",
+             keys[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+One operation is one point lookup on a cold cache: every round evicts all
+pages and asks the kernel to drop the file from its cache too, then looks
+up context->rows random ids, one table_get_row at a time or all at once
+through table_get_rows.
+*/
+uint64_t bench_point_lookup_cold_mode(BenchContext* context,
+                                      uint64_t iterations, bool batched) {
+  Pager* pager = context->table->pager;
+  uint32_t* keys = malloc(sizeof(uint32_t) * context->rows);
+  Row* rows = malloc(sizeof(Row) * context->rows);
+  bool* found = malloc(sizeof(bool) * context->rows);
+  uint64_t elapsed = 0;
+  for (uint64_t done = 0; done < iterations; done += context->rows) {
+    for (uint32_t i = 0; i < context->rows; i++) {
+      keys[i] = context->keys[bench_random(context) % context->rows];
+    }
+    bench_evict_all(pager);
+    fsync(pager->file_descriptor);
+    posix_fadvise(pager->file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+    uint64_t start = monotonic_ns();
+    if (batched) {
+      table_get_rows(context->table, keys, context->rows, rows, found);
+    } else {
+      for (uint32_t i = 0; i < context->rows; i++) {
+        found[i] = table_get_row(context->table, keys[i], &rows[i]);
+      }
+    }
+    elapsed += monotonic_ns() - start;
+    if (batched) {
+      bench_check_rows(context->table, keys, context->rows, rows, found);
+    }
+  }
+  free(keys);
+  free(rows);
+  free(found);
+  return elapsed;
+}
+
+uint64_t bench_point_lookup_cold(BenchContext* context, uint64_t iterations) {
+  return bench_point_lookup_cold_mode(context, iterations, false);
+}
+
+uint64_t bench_point_lookup_batched(BenchContext* context,
+                                    uint64_t iterations) {
+  return bench_point_lookup_cold_mode(context, iterations, true);
+}
+
+/*
+One operation is one row tested by "select where username >= 'v'", which
+matches nothing, after a vacuum into the given leaf layout
+*/
+uint64_t bench_filter_scan_layout(BenchContext* context, uint64_t iterations,
+                                  LeafLayout layout) {
+  *header_layout(get_page(context->table->pager, HEADER_PAGE_NUM)) = layout;
+  vacuum_table(context->table);
+  Predicate where = {true, COLUMN_USERNAME, COMPARE_GREATER_EQUAL, 0, "v"};
+  ResultBuffer out = {NULL, 0, 0};
+  uint64_t elapsed = 0;
+  for (uint64_t done = 0; done < iterations; done += context->rows) {
+    uint64_t start = monotonic_ns();
+    select_rows(&where, context->table, &out);
+    elapsed += monotonic_ns() - start;
+  }
+  free(out.data);
+  return elapsed;
+}
+
+uint64_t bench_filter_scan(BenchContext* context, uint64_t iterations) {
+  return bench_filter_scan_layout(context, iterations, LAYOUT_ROW);
+}
+
+uint64_t bench_filter_scan_pax(BenchContext* context, uint64_t iterations) {
+  return bench_filter_scan_layout(context, iterations, LAYOUT_PAX);
+}
+
+/* Every username is distinct, so this is the dictionary layout's worst case */
+uint64_t bench_filter_scan_dict(BenchContext* context, uint64_t iterations) {
+  return bench_filter_scan_layout(context, iterations, LAYOUT_DICT);
+}
+
+Benchmark benchmarks[] = {
+    {"leaf_node_find", bench_leaf_node_find, false},
+    {"internal_node_find_child", bench_internal_node_find_child, false},
+    {"leaf_node_insert", bench_leaf_node_insert, false},
+    {"leaf_split", bench_leaf_split, false},
+    {"insert_sequential", bench_insert_sequential, false},
+    {"get_page_hit", bench_get_page_hit, true},
+    {"get_page_miss", bench_get_page_miss, true},
+    {"serialize_row", bench_serialize_row, false},
+    {"deserialize_row", bench_deserialize_row, false},
+    {"page_checksum", bench_page_checksum, false},
+    {"full_scan", bench_full_scan, true},
+    {"point_lookup", bench_point_lookup, true},
+    {"point_lookup_cached", bench_point_lookup_cached, true},
+    {"point_lookup_cold", bench_point_lookup_cold, true},
+    {"point_lookup_batched", bench_point_lookup_batched, true},
+    {"filter_scan", bench_filter_scan, true},
+    {"filter_scan_pax", bench_filter_scan_pax, true},
+    {"filter_scan_dict", bench_filter_scan_dict, true},
+};
+
+/* Rows in the table for benchmarks that depend on table size */
+uint32_t table_sizes[] = {100, 500, 1000};
+
+bool is_size_dependent(Benchmark* benchmark) {
+  return benchmark->needs_table || benchmark->run == bench_insert_sequential;
+}
+
+void run_benchmark(Benchmark* benchmark, uint32_t rows) {
+  BenchContext context;
+  memset(&context, 0, sizeof(BenchContext));
+  context.rows = rows;
+  context.rng = 0x9E3779B97F4A7C15ULL;
+  if (benchmark->needs_table) {
+    bench_build_table(&context);
+  }
+
+  uint64_t iterations = 1;
+  uint64_t elapsed = 0;
+  while (true) {
+    elapsed = benchmark->run(&context, iterations);
+    if (elapsed >= bench_min_time_ns || iterations >= (1ULL << 40)) {
+      break;
+    }
+    /* Aim a bit past the minimum time so the next run usually qualifies */
+    uint64_t scale = elapsed > 0 ? (bench_min_time_ns * 12 / 10) / elapsed : 100;
+    if (scale < 2) {
+      scale = 2;
+    } else if (scale > 100) {
+      scale = 100;
+    }
+    iterations *= scale;
+  }
+
+  double best = (double)elapsed / iterations;
+  for (uint32_t i = 1; i < bench_repetitions; i++) {
+    double ns_per_op = (double)benchmark->run(&context, iterations) / iterations;
+    if (ns_per_op < best) {
+      best = ns_per_op;
+    }
+  }
+
+  printf("{\"benchmark\":\"%s\",\"rows\":%d,\"iterations\":%" PRIu64
+         ",\"ns_per_op\":%.2f}\n",
+         benchmark->name, rows, iterations, best);
+  fflush(stdout);
+
+  if (benchmark->needs_table) {
+    bench_close_table(&context);
+    free(context.keys);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      bench_filter = argv[++i];
+    } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      bench_min_time_ns = strtoull(argv[++i], NULL, 10) * 1000000ULL;
+    } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+      bench_repetitions = atoi(argv[++i]);
+    } else {
+      printf("Usage: %s [--filter substring] [--min-time ms] "
+             "[--repetitions n]\n",
+             argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  uint32_t num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  uint32_t num_sizes = sizeof(table_sizes) / sizeof(table_sizes[0]);
+  for (uint32_t i = 0; i < num_benchmarks; i++) {
+    Benchmark* benchmark = &benchmarks[i];
+    if (bench_filter != NULL && strstr(benchmark->name, bench_filter) == NULL) {
+      continue;
+    }
+    if (is_size_dependent(benchmark)) {
+      for (uint32_t j = 0; j < num_sizes; j++) {
+        run_benchmark(benchmark, table_sizes[j]);
+      }
+    } else {
+      run_benchmark(benchmark, LEAF_NODE_MAX_CELLS);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,1132 @@
+/*
+YCSB-style workload driver. Loads --records rows, then runs --operations
+operations drawn from a read/update/insert/scan mix over a uniform,
+zipfian or latest key distribution, from --threads client threads, all
+in-process against the engine. Prints throughput and per-operation
+latency percentiles.
+
+The engine has no internal latching, so client threads take a single
+table mutex around each operation. A partitioned table (--partitions) has
+a mutex per partition instead, so operations on different partitions run
+in parallel. With --shards, each partition is owned by a worker thread and
+clients send it requests over lock-free rings, with no mutex at all.
+With --writer on, client threads queue their inserts and updates for a
+single writer thread, which applies them in sorted batches under one
+acquisition of the lock.
+Latencies include time spent waiting, as a client would see.
+
+Usage: ycsb [--workload a|b|c|d|e] [--records n] [--operations n]
+            [--threads n] [--read p] [--update p] [--insert p] [--scan p]
+            [--distribution uniform|zipfian|latest] [--scan-length n]
+            [--file path] [--engine btree|lsm|betree]
+            [--index none|hash] [--bloom on|off] [--row-cache n]
+            [--partitions n | --shards n] [--partition-by hash|range]
+            [--writer on|off]
+*/
+#define NOTTOSQL_NO_MAIN
+#include "../db.c"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+Rough row capacity of a TABLE_MAX_PAGES table when the inserts come in
+key order, which leaves every leaf half full. Going over it would make
+get_page bail out halfway through a run.
+*/
+#define YCSB_MAX_ROWS 1500
+#define ZIPFIAN_CONSTANT 0.99
+
+typedef enum {
+  DISTRIBUTION_UNIFORM,
+  DISTRIBUTION_ZIPFIAN,
+  DISTRIBUTION_LATEST
+} Distribution;
+
+typedef enum { OP_READ, OP_UPDATE, OP_INSERT, OP_SCAN } OperationType;
+#define OPERATION_TYPE_COUNT 4
+
+const char* operation_names[OPERATION_TYPE_COUNT] = {"read", "update",
+                                                     "insert", "scan"};
+
+typedef struct {
+  double proportions[OPERATION_TYPE_COUNT];
+  Distribution distribution;
+  uint32_t records;
+  uint64_t operations;
+  uint32_t threads;
+  uint32_t scan_length;
+  const char* filename;
+  Engine engine;
+  bool hash_index;
+  bool bloom;
+  uint32_t row_cache;  // rows, 0 for none
+  uint32_t partitions;  // 0 for none
+  PartitionScheme partition_scheme;
+  bool sharded;  // a worker thread per partition, see run_shard
+  bool writer;   // writes go through run_writer
+} WorkloadConfig;
+
+/* Zipfian generator from Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB */
+typedef struct {
+  uint64_t items;
+  double theta;
+  double zetan;
+  double alpha;
+  double eta;
+} ZipfianGenerator;
+
+/*
+Sharded mode. Every partition is owned by a worker thread, and client
+threads hand it requests over single-producer single-consumer rings, one
+per client and shard. Nothing on the way takes a lock: a ring's producer
+only moves its tail and its consumer only moves its head.
+*/
+#define SHARD_RING_SIZE 16  // a power of two
+
+typedef struct {
+  OperationType type;
+  uint32_t key;
+  uint32_t length;  // rows, for scans
+  uint64_t salt;
+  bool found;
+  uint32_t done;  // set once found and count are filled in
+  uint32_t* keys;  // scans put the ids they read here, if not NULL
+  uint32_t count;  // rows a scan read
+} QueuedRequest;
+
+typedef struct {
+  QueuedRequest* slots[SHARD_RING_SIZE];
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));  // consumer's
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  // producer's
+} SpscRing;
+
+/*
+Writer mode. Client threads queue inserts and updates on a bounded
+multi-producer single-consumer ring (Vyukov's): a producer claims a slot
+by moving tail with a CAS, and the slot's sequence tells the writer when
+the request in it has been filled in.
+*/
+#define WRITE_RING_SIZE 256  // a power of two
+#define WRITE_BATCH_SIZE 64
+
+typedef struct {
+  uint32_t sequence;
+  QueuedRequest* request;
+} MpscSlot;
+
+typedef struct {
+  MpscSlot slots[WRITE_RING_SIZE];
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));  // writer's
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  // producers'
+} MpscRing;
+
+typedef struct {
+  Table* table;
+  WorkloadConfig* config;
+  ZipfianGenerator zipfian;
+  pthread_mutex_t lock;
+  pthread_mutex_t partition_locks[MAX_PARTITIONS];
+  uint32_t next_claimed_key;  // atomically incremented by inserts
+  uint32_t next_insert_key;   // every key below it has been inserted
+  uint8_t* inserted;          // by key, set once that key's insert is done
+  SpscRing* rings;            // by client, then shard
+  uint32_t shards_running;
+  MpscRing* write_ring;
+  uint32_t writer_running;
+} Workload;
+
+typedef struct {
+  Workload* workload;
+  uint32_t index;
+} ShardThread;
+
+typedef struct {
+  Workload* workload;
+  uint32_t index;
+  uint64_t operations;
+  uint64_t rng;
+  Histogram latency[OPERATION_TYPE_COUNT];
+  uint64_t not_found;
+} ClientThread;
+
+uint64_t next_random(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+double next_double(uint64_t* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    sum += 1 / pow(i + 1, theta);
+  }
+  return sum;
+}
+
+void zipfian_init(ZipfianGenerator* zipfian, uint64_t items, double theta) {
+  zipfian->items = items;
+  zipfian->theta = theta;
+  zipfian->zetan = zeta(items, theta);
+  double zeta2 = zeta(2, theta);
+  zipfian->alpha = 1.0 / (1.0 - theta);
+  zipfian->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zipfian->zetan);
+}
+
+/* Returns a rank in [0, items), rank 0 being the most popular */
+uint64_t zipfian_next(ZipfianGenerator* zipfian, uint64_t* rng) {
+  double u = next_double(rng);
+  double uz = u * zipfian->zetan;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, zipfian->theta)) {
+    return 1;
+  }
+  return (uint64_t)(zipfian->items *
+                    pow(zipfian->eta * u - zipfian->eta + 1, zipfian->alpha));
+}
+
+/* FNV-1a, used to scatter zipfian ranks over the key space like YCSB */
+uint64_t fnv_hash(uint64_t value) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (int i = 0; i < 8; i++) {
+    hash ^= value & 0xFF;
+    hash *= 1099511628211ULL;
+    value >>= 8;
+  }
+  return hash;
+}
+
+/* Picks an existing key, keys being 1..next_insert_key - 1 */
+uint32_t choose_key(ClientThread* client) {
+  Workload* workload = client->workload;
+  uint32_t max_key =
+      __atomic_load_n(&workload->next_insert_key, __ATOMIC_ACQUIRE) - 1;
+  uint64_t rank;
+  switch (workload->config->distribution) {
+    case (DISTRIBUTION_UNIFORM):
+      return 1 + next_random(&client->rng) % max_key;
+    case (DISTRIBUTION_ZIPFIAN):
+      rank = zipfian_next(&workload->zipfian, &client->rng);
+      return 1 + fnv_hash(rank) % max_key;
+    case (DISTRIBUTION_LATEST):
+      rank = zipfian_next(&workload->zipfian, &client->rng);
+      return rank >= max_key ? 1 : max_key - rank;
+  }
+  return 1;
+}
+
+OperationType choose_operation(ClientThread* client) {
+  double u = next_double(&client->rng);
+  double* proportions = client->workload->config->proportions;
+  for (uint32_t i = 0; i < OPERATION_TYPE_COUNT; i++) {
+    if (u < proportions[i]) {
+      return i;
+    }
+    u -= proportions[i];
+  }
+  return OP_READ;
+}
+
+void make_row(Row* row, uint32_t id, uint64_t salt) {
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%d", id);
+  snprintf(row->email, sizeof(row->email), "person%d.%" PRIu64 "@example.com",
+           id, salt);
+}
+
+/* The table lock, or the lock of the partition holding key */
+pthread_mutex_t* key_lock(Workload* workload, uint32_t key) {
+  Table* table = workload->table;
+  if (table->num_partitions == 0) {
+    return &workload->lock;
+  }
+  return &workload->partition_locks[table_partition_index(table, key)];
+}
+
+/*
+Row cache hits only take their shard's lock, so reads of hot keys don't
+queue behind the table lock; misses take it and fill the cache.
+*/
+bool do_read(Workload* workload, uint32_t key, Row* row) {
+  Table* table = table_partition(workload->table, key);
+  if (table->row_cache != NULL && row_cache_get(table->row_cache, key, row)) {
+    return true;
+  }
+  pthread_mutex_t* lock = key_lock(workload, key);
+  pthread_mutex_lock(lock);
+  bool found = table_get_row(table, key, row);
+  pthread_mutex_unlock(lock);
+  return found;
+}
+
+/* Reads up to length rows from start_key on, noting their ids in keys */
+uint32_t scan_table(Table* table, uint32_t start_key, uint32_t length,
+                    uint32_t* keys) {
+  Cursor* cursor = table_seek(table, start_key);
+  Row row;
+  uint32_t scanned = 0;
+  while (!(cursor->end_of_table) && scanned < length) {
+    deserialize_row(cursor_value(cursor), &row);
+    if (keys != NULL) {
+      keys[scanned] = row.id;
+    }
+    cursor_advance(cursor);
+    scanned++;
+  }
+  free(cursor);
+  return scanned;
+}
+
+/*
+Hash partitions each hold a share of any key range, so their cursors are
+merged in key order, under every partition lock, until length rows have
+come out
+*/
+uint32_t merge_scan(Workload* workload, uint32_t start_key, uint32_t length) {
+  Table* table = workload->table;
+  Cursor* cursors[MAX_PARTITIONS];
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    pthread_mutex_lock(&workload->partition_locks[i]);
+    cursors[i] = table_seek(table->partitions[i], start_key);
+  }
+  Row row;
+  uint32_t scanned = 0;
+  while (scanned < length) {
+    Cursor* next = NULL;
+    uint32_t next_key = 0;
+    for (uint32_t i = 0; i < table->num_partitions; i++) {
+      if (cursors[i]->end_of_table) {
+        continue;
+      }
+      uint32_t key = *(uint32_t*)cursor_column(cursors[i], COLUMN_ID);
+      if (next == NULL || key < next_key) {
+        next = cursors[i];
+        next_key = key;
+      }
+    }
+    if (next == NULL) {
+      break;
+    }
+    deserialize_row(cursor_value(next), &row);
+    cursor_advance(next);
+    scanned++;
+  }
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    free(cursors[i]);
+    pthread_mutex_unlock(&workload->partition_locks[i]);
+  }
+  return scanned;
+}
+
+/*
+A scan reads the same rows on a partitioned table as on a plain one. With
+range partitions it starts in the partition holding start_key and only
+moves on to the next one while it is short of length rows.
+*/
+uint32_t do_scan(Workload* workload, uint32_t start_key, uint32_t length) {
+  Table* table = workload->table;
+  if (table->num_partitions == 0) {
+    pthread_mutex_lock(&workload->lock);
+    uint32_t scanned = scan_table(table, start_key, length, NULL);
+    pthread_mutex_unlock(&workload->lock);
+    return scanned;
+  }
+  if (table->partition_scheme == PARTITION_HASH) {
+    return merge_scan(workload, start_key, length);
+  }
+  uint32_t scanned = 0;
+  for (uint32_t i = table_partition_index(table, start_key);
+       i < table->num_partitions && scanned < length; i++) {
+    pthread_mutex_lock(&workload->partition_locks[i]);
+    scanned +=
+        scan_table(table->partitions[i], start_key, length - scanned, NULL);
+    pthread_mutex_unlock(&workload->partition_locks[i]);
+  }
+  return scanned;
+}
+
+uint32_t claim_insert_key(Workload* workload) {
+  return __atomic_fetch_add(&workload->next_claimed_key, 1, __ATOMIC_RELAXED);
+}
+
+/*
+Inserts into different partitions can finish out of order, and choose_key
+must only see keys whose inserts are done. An insert marks its key done,
+then moves next_insert_key past every done key in a row. It never waits
+for a slower insert of a lower key: that one's own publish carries the
+mark past this key later. The sequentially consistent operations make
+sure at least one of the two sees the other's mark.
+*/
+void publish_insert_key(Workload* workload, uint32_t key) {
+  __atomic_store_n(&workload->inserted[key], 1, __ATOMIC_SEQ_CST);
+  uint32_t mark = __atomic_load_n(&workload->next_insert_key, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&workload->inserted[mark], __ATOMIC_SEQ_CST)) {
+    /* On failure mark is reloaded, another insert having moved it */
+    if (__atomic_compare_exchange_n(&workload->next_insert_key, &mark,
+                                    mark + 1, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST)) {
+      mark++;
+    }
+  }
+}
+
+void do_insert(Workload* workload, uint64_t salt) {
+  uint32_t key = claim_insert_key(workload);
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  make_row(&statement.row_to_insert, key, salt);
+  pthread_mutex_t* lock = key_lock(workload, key);
+  pthread_mutex_lock(lock);
+  execute_insert(&statement, table_partition(workload->table, key));
+  pthread_mutex_unlock(lock);
+  publish_insert_key(workload, key);
+}
+
+void spsc_push(SpscRing* ring, QueuedRequest* request) {
+  uint32_t tail = ring->tail;
+  while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+         SHARD_RING_SIZE) {
+    sched_yield();
+  }
+  ring->slots[tail % SHARD_RING_SIZE] = request;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* NULL when the ring is empty */
+QueuedRequest* spsc_pop(SpscRing* ring) {
+  uint32_t head = ring->head;
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  QueuedRequest* request = ring->slots[head % SHARD_RING_SIZE];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return request;
+}
+
+void execute_queued(Table* table, QueuedRequest* request) {
+  Statement statement;
+  Row row;
+  switch (request->type) {
+    case (OP_READ):
+      request->found = table_get_row(table, request->key, &row);
+      break;
+    case (OP_UPDATE):
+      statement.type = STATEMENT_UPDATE;
+      make_row(&statement.row_to_insert, request->key, request->salt);
+      request->found = execute_update(&statement, table) == EXECUTE_SUCCESS;
+      break;
+    case (OP_INSERT):
+      statement.type = STATEMENT_INSERT;
+      make_row(&statement.row_to_insert, request->key, request->salt);
+      request->found = execute_insert(&statement, table) == EXECUTE_SUCCESS;
+      break;
+    case (OP_SCAN):
+      request->count =
+          scan_table(table, request->key, request->length, request->keys);
+      request->found = true;
+      break;
+  }
+  __atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+}
+
+void request_wait(QueuedRequest* request) {
+  while (!__atomic_load_n(&request->done, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+void mpsc_init(MpscRing* ring) {
+  memset(ring, 0, sizeof(MpscRing));
+  for (uint32_t i = 0; i < WRITE_RING_SIZE; i++) {
+    ring->slots[i].sequence = i;
+  }
+}
+
+void mpsc_push(MpscRing* ring, QueuedRequest* request) {
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  MpscSlot* slot;
+  while (true) {
+    slot = &ring->slots[tail % WRITE_RING_SIZE];
+    int32_t lag =
+        (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - tail);
+    if (lag == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else {
+      if (lag < 0) {
+        sched_yield();  // full, wait for the writer to drain a slot
+      }
+      tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->request = request;
+  __atomic_store_n(&slot->sequence, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* NULL when the ring is empty or its next slot is still being filled */
+QueuedRequest* mpsc_pop(MpscRing* ring) {
+  MpscSlot* slot = &ring->slots[ring->head % WRITE_RING_SIZE];
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1) {
+    return NULL;
+  }
+  QueuedRequest* request = slot->request;
+  __atomic_store_n(&slot->sequence, ring->head + WRITE_RING_SIZE,
+                   __ATOMIC_RELEASE);
+  ring->head++;
+  return request;
+}
+
+/* Queues an insert or update for the writer and waits for it to apply */
+bool queue_write(Workload* workload, OperationType type, uint32_t key,
+                 uint64_t salt) {
+  QueuedRequest request = {type, key, 0, salt, false, 0};
+  mpsc_push(workload->write_ring, &request);
+  request_wait(&request);
+  return request.found;
+}
+
+int compare_request_keys(const void* a, const void* b) {
+  uint32_t key_a = (*(QueuedRequest* const*)a)->key;
+  uint32_t key_b = (*(QueuedRequest* const*)b)->key;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+/*
+The only thread that writes. It drains up to WRITE_BATCH_SIZE requests at
+a time and applies them in key order, so neighbouring writes land in the
+same leaf one after the other, and holds a lock across every run of
+requests that need the same one. Batches grow with the queue, so the
+busier the clients the fewer lock round trips per write. Like every ycsb
+write, they go through execute_insert and execute_update, which keep the
+hash index, bloom filter and row cache current but, unlike
+execute_statement, append nothing to a replication log.
+*/
+void* run_writer(void* argument) {
+  Workload* workload = argument;
+  QueuedRequest* batch[WRITE_BATCH_SIZE];
+  while (true) {
+    uint32_t count = 0;
+    while (count < WRITE_BATCH_SIZE &&
+           (batch[count] = mpsc_pop(workload->write_ring)) != NULL) {
+      count++;
+    }
+    if (count == 0) {
+      if (!__atomic_load_n(&workload->writer_running, __ATOMIC_ACQUIRE)) {
+        return NULL;
+      }
+      sched_yield();
+      continue;
+    }
+    qsort(batch, count, sizeof(QueuedRequest*), compare_request_keys);
+    pthread_mutex_t* held = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+      pthread_mutex_t* lock = key_lock(workload, batch[i]->key);
+      if (lock != held) {
+        if (held != NULL) {
+          pthread_mutex_unlock(held);
+        }
+        pthread_mutex_lock(lock);
+        held = lock;
+      }
+      execute_queued(table_partition(workload->table, batch[i]->key),
+                     batch[i]);
+    }
+    pthread_mutex_unlock(held);
+  }
+}
+
+void* run_client(void* argument) {
+  ClientThread* client = argument;
+  Workload* workload = client->workload;
+  Statement statement;
+  Row row;
+
+  for (uint64_t i = 0; i < client->operations; i++) {
+    OperationType type = choose_operation(client);
+    uint64_t start = monotonic_ns();
+    uint32_t key;
+    pthread_mutex_t* lock;
+    switch (type) {
+      case (OP_READ):
+        if (!do_read(workload, choose_key(client), &row)) {
+          client->not_found++;
+        }
+        break;
+      case (OP_UPDATE):
+        key = choose_key(client);
+        if (workload->write_ring != NULL) {
+          if (!queue_write(workload, OP_UPDATE, key, i)) {
+            client->not_found++;
+          }
+          break;
+        }
+        statement.type = STATEMENT_UPDATE;
+        make_row(&statement.row_to_insert, key, i);
+        lock = key_lock(workload, key);
+        pthread_mutex_lock(lock);
+        if (execute_update(&statement, table_partition(workload->table,
+                                                       key)) !=
+            EXECUTE_SUCCESS) {
+          client->not_found++;
+        }
+        pthread_mutex_unlock(lock);
+        break;
+      case (OP_INSERT):
+        if (workload->write_ring != NULL) {
+          key = claim_insert_key(workload);
+          queue_write(workload, OP_INSERT, key, i);
+          publish_insert_key(workload, key);
+          break;
+        }
+        do_insert(workload, i);
+        break;
+      case (OP_SCAN):
+        /* Key first, in the same order as run_sharded_client draws them */
+        key = choose_key(client);
+        do_scan(workload, key,
+                1 + next_random(&client->rng) % workload->config->scan_length);
+        break;
+    }
+    histogram_record(&client->latency[type], monotonic_ns() - start);
+  }
+  return NULL;
+}
+
+/* Serves its partition's rings until the clients are done */
+void* run_shard(void* argument) {
+  ShardThread* shard = argument;
+  Workload* workload = shard->workload;
+  uint32_t num_shards = workload->table->num_partitions;
+  Table* table = workload->table->partitions[shard->index];
+  while (true) {
+    bool idle = true;
+    for (uint32_t i = 0; i < workload->config->threads; i++) {
+      SpscRing* ring = &workload->rings[i * num_shards + shard->index];
+      QueuedRequest* request;
+      while ((request = spsc_pop(ring)) != NULL) {
+        execute_queued(table, request);
+        idle = false;
+      }
+    }
+    if (idle) {
+      if (!__atomic_load_n(&workload->shards_running, __ATOMIC_ACQUIRE)) {
+        return NULL;
+      }
+      sched_yield();
+    }
+  }
+}
+
+void shard_send(ClientThread* client, uint32_t shard, QueuedRequest* request) {
+  Workload* workload = client->workload;
+  request->done = 0;
+  spsc_push(
+      &workload->rings[client->index * workload->table->num_partitions + shard],
+      request);
+}
+
+/* Sends a request to a shard and waits for it to be done */
+void shard_call(ClientThread* client, uint32_t shard, QueuedRequest* request) {
+  shard_send(client, shard, request);
+  request_wait(request);
+}
+
+/*
+merge_scan over shards, which the client can't take cursors on. Every
+shard first sends back the ids of its next length / shards rows, all at
+once. The merge then takes the smallest id, and asks a shard for another,
+smaller batch only when it has used up a full one. Together the shards
+read about length rows rather than length each.
+*/
+uint32_t sharded_merge_scan(ClientThread* client, uint32_t start_key,
+                            uint32_t length) {
+  uint32_t num_shards = client->workload->table->num_partitions;
+  uint32_t batch = (length + num_shards - 1) / num_shards;
+  uint32_t* keys = malloc(sizeof(uint32_t) * batch * num_shards);
+  QueuedRequest requests[MAX_PARTITIONS];
+  uint32_t positions[MAX_PARTITIONS];
+  for (uint32_t shard = 0; shard < num_shards; shard++) {
+    requests[shard] = (QueuedRequest){
+        OP_SCAN, start_key, batch, 0, false, 0, &keys[shard * batch], 0};
+    positions[shard] = 0;
+    shard_send(client, shard, &requests[shard]);
+  }
+  for (uint32_t shard = 0; shard < num_shards; shard++) {
+    request_wait(&requests[shard]);
+  }
+
+  uint32_t merged = 0;
+  while (merged < length) {
+    int32_t next = -1;
+    for (uint32_t shard = 0; shard < num_shards; shard++) {
+      QueuedRequest* request = &requests[shard];
+      if (positions[shard] == request->length) {
+        uint32_t remaining = (length - merged + num_shards - 1) / num_shards;
+        request->key = request->keys[request->count - 1] + 1;
+        request->length = remaining < batch ? remaining : batch;
+        positions[shard] = 0;
+        shard_call(client, shard, request);
+      }
+      if (positions[shard] < request->count &&
+          (next == -1 || request->keys[positions[shard]] <
+                             requests[next].keys[positions[next]])) {
+        next = shard;
+      }
+    }
+    if (next == -1) {
+      break;
+    }
+    positions[next]++;
+    merged++;
+  }
+  free(keys);
+  return merged;
+}
+
+/*
+run_client for sharded mode. A scan reads the rows it would on one table:
+over range shards it goes from the shard holding start_key to the next
+while it is short of rows, over hash shards it merges them.
+*/
+void* run_sharded_client(void* argument) {
+  ClientThread* client = argument;
+  Workload* workload = client->workload;
+  Table* table = workload->table;
+  QueuedRequest request;
+
+  for (uint64_t i = 0; i < client->operations; i++) {
+    OperationType type = choose_operation(client);
+    uint64_t start = monotonic_ns();
+    if (type == OP_SCAN) {
+      uint32_t key = choose_key(client);
+      uint32_t length =
+          1 + next_random(&client->rng) % workload->config->scan_length;
+      if (table->partition_scheme == PARTITION_HASH) {
+        sharded_merge_scan(client, key, length);
+      } else {
+        uint32_t scanned = 0;
+        for (uint32_t shard = table_partition_index(table, key);
+             shard < table->num_partitions && scanned < length; shard++) {
+          request =
+              (QueuedRequest){OP_SCAN, key, length - scanned, i, false, 0};
+          shard_call(client, shard, &request);
+          scanned += request.count;
+        }
+      }
+    } else {
+      uint32_t key =
+          type == OP_INSERT ? claim_insert_key(workload) : choose_key(client);
+      request = (QueuedRequest){type, key, 0, i, false, 0};
+      shard_call(client, table_partition_index(table, key), &request);
+      if (type == OP_INSERT) {
+        publish_insert_key(workload, request.key);
+      } else if (!request.found) {
+        client->not_found++;
+      }
+    }
+    histogram_record(&client->latency[type], monotonic_ns() - start);
+  }
+  return NULL;
+}
+
+void load_records(Workload* workload) {
+  uint32_t records = workload->config->records;
+  uint32_t* keys = malloc(sizeof(uint32_t) * records);
+  for (uint32_t i = 0; i < records; i++) {
+    keys[i] = i + 1;
+  }
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  for (uint32_t i = records; i > 1; i--) {
+    uint32_t j = next_random(&rng) % i;
+    uint32_t tmp = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = tmp;
+  }
+
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  for (uint32_t i = 0; i < records; i++) {
+    make_row(&statement.row_to_insert, keys[i], 0);
+    execute_insert(&statement, workload->table);
+  }
+  workload->next_insert_key = records + 1;
+  workload->next_claimed_key = records + 1;
+  free(keys);
+}
+
+void histogram_merge(Histogram* destination, Histogram* source) {
+  for (uint32_t i = 0; i < HISTOGRAM_COUNTS; i++) {
+    destination->counts[i] += source->counts[i];
+  }
+  destination->total_count += source->total_count;
+  if (source->max_value > destination->max_value) {
+    destination->max_value = source->max_value;
+  }
+}
+
+void set_proportions(WorkloadConfig* config, double read, double update,
+                     double insert, double scan) {
+  config->proportions[OP_READ] = read;
+  config->proportions[OP_UPDATE] = update;
+  config->proportions[OP_INSERT] = insert;
+  config->proportions[OP_SCAN] = scan;
+}
+
+/* The core YCSB workloads, minus F (read-modify-write) */
+bool apply_preset(WorkloadConfig* config, const char* name) {
+  switch (name[0]) {
+    case ('a'):
+      set_proportions(config, 0.5, 0.5, 0, 0);
+      config->distribution = DISTRIBUTION_ZIPFIAN;
+      return true;
+    case ('b'):
+      set_proportions(config, 0.95, 0.05, 0, 0);
+      config->distribution = DISTRIBUTION_ZIPFIAN;
+      return true;
+    case ('c'):
+      set_proportions(config, 1, 0, 0, 0);
+      config->distribution = DISTRIBUTION_ZIPFIAN;
+      return true;
+    case ('d'):
+      set_proportions(config, 0.95, 0, 0.05, 0);
+      config->distribution = DISTRIBUTION_LATEST;
+      return true;
+    case ('e'):
+      set_proportions(config, 0, 0, 0.05, 0.95);
+      config->distribution = DISTRIBUTION_ZIPFIAN;
+      return true;
+  }
+  return false;
+}
+
+bool parse_distribution(WorkloadConfig* config, const char* name) {
+  if (strcmp(name, "uniform") == 0) {
+    config->distribution = DISTRIBUTION_UNIFORM;
+  } else if (strcmp(name, "zipfian") == 0) {
+    config->distribution = DISTRIBUTION_ZIPFIAN;
+  } else if (strcmp(name, "latest") == 0) {
+    config->distribution = DISTRIBUTION_LATEST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* distribution_name(Distribution distribution) {
+  switch (distribution) {
+    case (DISTRIBUTION_UNIFORM):
+      return "uniform";
+    case (DISTRIBUTION_ZIPFIAN):
+      return "zipfian";
+    case (DISTRIBUTION_LATEST):
+      return "latest";
+  }
+  return "unknown";
+}
+
+void usage(const char* program) {
+  printf("Usage: %s [--workload a|b|c|d|e] [--records n] [--operations n]\n"
+         "          [--threads n] [--read p] [--update p] [--insert p] "
+         "[--scan p]\n"
+         "          [--distribution uniform|zipfian|latest] "
+         "[--scan-length n]\n"
+         "          [--file path] [--engine btree|lsm|betree]\n"
+         "          [--index none|hash] [--bloom on|off] "
+         "[--row-cache n]\n"
+         "          [--partitions n | --shards n] "
+         "[--partition-by hash|range]\n"
+         "          [--writer on|off]\n",
+         program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  WorkloadConfig config;
+  memset(&config, 0, sizeof(WorkloadConfig));
+  config.partition_scheme = PARTITION_HASH;
+  apply_preset(&config, "a");
+  config.records = 1000;
+  config.operations = 100000;
+  config.threads = 1;
+  config.scan_length = 100;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char* option = argv[i];
+    const char* value = argv[++i];
+    if (strcmp(option, "--workload") == 0) {
+      if (!apply_preset(&config, value)) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--records") == 0) {
+      config.records = atoi(value);
+    } else if (strcmp(option, "--operations") == 0) {
+      config.operations = strtoull(value, NULL, 10);
+    } else if (strcmp(option, "--threads") == 0) {
+      config.threads = atoi(value);
+    } else if (strcmp(option, "--read") == 0) {
+      config.proportions[OP_READ] = atof(value);
+    } else if (strcmp(option, "--update") == 0) {
+      config.proportions[OP_UPDATE] = atof(value);
+    } else if (strcmp(option, "--insert") == 0) {
+      config.proportions[OP_INSERT] = atof(value);
+    } else if (strcmp(option, "--scan") == 0) {
+      config.proportions[OP_SCAN] = atof(value);
+    } else if (strcmp(option, "--distribution") == 0) {
+      if (!parse_distribution(&config, value)) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--scan-length") == 0) {
+      config.scan_length = atoi(value);
+    } else if (strcmp(option, "--file") == 0) {
+      config.filename = value;
+    } else if (strcmp(option, "--index") == 0) {
+      if (strcmp(value, "none") == 0) {
+        config.hash_index = false;
+      } else if (strcmp(value, "hash") == 0) {
+        config.hash_index = true;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--bloom") == 0) {
+      if (strcmp(value, "off") == 0) {
+        config.bloom = false;
+      } else if (strcmp(value, "on") == 0) {
+        config.bloom = true;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--writer") == 0) {
+      if (strcmp(value, "off") == 0) {
+        config.writer = false;
+      } else if (strcmp(value, "on") == 0) {
+        config.writer = true;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--row-cache") == 0) {
+      config.row_cache = atoi(value);
+    } else if (strcmp(option, "--partitions") == 0) {
+      config.partitions = atoi(value);
+      config.sharded = false;
+    } else if (strcmp(option, "--shards") == 0) {
+      config.partitions = atoi(value);
+      config.sharded = true;
+    } else if (strcmp(option, "--partition-by") == 0) {
+      if (strcmp(value, "hash") == 0) {
+        config.partition_scheme = PARTITION_HASH;
+      } else if (strcmp(value, "range") == 0) {
+        config.partition_scheme = PARTITION_RANGE;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(option, "--engine") == 0) {
+      if (strcmp(value, "btree") == 0) {
+        config.engine = ENGINE_BTREE;
+      } else if (strcmp(value, "lsm") == 0) {
+        config.engine = ENGINE_LSM;
+      } else if (strcmp(value, "betree") == 0) {
+        config.engine = ENGINE_BETREE;
+      } else {
+        usage(argv[0]);
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  double total = 0;
+  for (uint32_t i = 0; i < OPERATION_TYPE_COUNT; i++) {
+    total += config.proportions[i];
+  }
+  if (total <= 0 || config.records == 0 || config.threads == 0 ||
+      config.scan_length == 0 ||
+      (config.hash_index && config.engine != ENGINE_BTREE) ||
+      (config.bloom && config.engine == ENGINE_LSM) ||
+      config.partitions == 1 || config.partitions > MAX_PARTITIONS ||
+      (config.sharded && config.partitions == 0) ||
+      (config.sharded && config.writer)) {
+    usage(argv[0]);
+  }
+  for (uint32_t i = 0; i < OPERATION_TYPE_COUNT; i++) {
+    config.proportions[i] /= total;
+  }
+  /* Leave headroom over the expected number of inserts */
+  double expected_inserts = config.operations * config.proportions[OP_INSERT];
+  uint32_t max_rows =
+      YCSB_MAX_ROWS * (config.partitions > 0 ? config.partitions : 1);
+  if (config.records + expected_inserts * 1.1 > max_rows) {
+    printf("Workload would grow the table past %d rows.\n", max_rows);
+    exit(EXIT_FAILURE);
+  }
+
+  char filename[64];
+  if (config.filename == NULL) {
+    strcpy(filename, "/tmp/nottosql-ycsb-XXXXXX");
+    int fd = mkstemp(filename);
+    if (fd == -1) {
+      printf("Unable to create workload file\n");
+      exit(EXIT_FAILURE);
+    }
+    close(fd);
+  } else {
+    unlink(config.filename);
+  }
+
+  Workload workload;
+  workload.config = &config;
+  workload.table = db_open(config.filename ? config.filename : filename);
+  if (config.partitions > 0) {
+    /* Range partitions split the keys the run is expected to end with */
+    uint32_t width =
+        (config.records + expected_inserts) / config.partitions + 1;
+    table_partition_into(workload.table, config.partition_scheme,
+                         config.partitions, width);
+  }
+  /* Each partition gets the engine and the structures of its own */
+  uint32_t num_tables = config.partitions > 0 ? config.partitions : 1;
+  for (uint32_t i = 0; i < num_tables; i++) {
+    Table* table = config.partitions > 0 ? workload.table->partitions[i]
+                                         : workload.table;
+    table_set_engine(table, config.engine);
+    if (config.hash_index) {
+      hash_index_build(table);
+    }
+    if (config.bloom) {
+      table_bloom_build(table);
+    }
+    if (config.row_cache > 0) {
+      table->row_cache = row_cache_new(config.row_cache);
+    }
+  }
+  pthread_mutex_init(&workload.lock, NULL);
+  /* Keys run up to records + operations, if every operation inserts */
+  workload.inserted = calloc(config.records + config.operations + 2, 1);
+  for (uint32_t i = 0; i < MAX_PARTITIONS; i++) {
+    pthread_mutex_init(&workload.partition_locks[i], NULL);
+  }
+  zipfian_init(&workload.zipfian, config.records, ZIPFIAN_CONSTANT);
+
+  printf("workload: read=%.2f update=%.2f insert=%.2f scan=%.2f "
+         "distribution=%s records=%d operations=%" PRIu64 " threads=%d "
+         "engine=%s index=%s bloom=%s row_cache=%d partitions=%d "
+         "partition_by=%s sharded=%s writer=%s\n",
+         config.proportions[OP_READ], config.proportions[OP_UPDATE],
+         config.proportions[OP_INSERT], config.proportions[OP_SCAN],
+         distribution_name(config.distribution), config.records,
+         config.operations, config.threads, engine_name(config.engine),
+         config.hash_index ? "hash" : "none", config.bloom ? "on" : "off",
+         config.row_cache, config.partitions,
+         config.partitions == 0
+             ? "none"
+             : partition_scheme_name(config.partition_scheme),
+         config.sharded ? "yes" : "no", config.writer ? "on" : "off");
+
+  uint64_t load_start = monotonic_ns();
+  load_records(&workload);
+  double load_seconds = (monotonic_ns() - load_start) / 1e9;
+  printf("load: %d records in %.3fs, %.0f ops/sec\n", config.records,
+         load_seconds, config.records / load_seconds);
+
+  ClientThread* clients = calloc(config.threads, sizeof(ClientThread));
+  pthread_t* threads = malloc(sizeof(pthread_t) * config.threads);
+  for (uint32_t i = 0; i < config.threads; i++) {
+    clients[i].workload = &workload;
+    clients[i].index = i;
+    clients[i].operations = config.operations / config.threads +
+                            (i < config.operations % config.threads ? 1 : 0);
+    clients[i].rng = fnv_hash(i + 1);
+  }
+
+  ShardThread shards[MAX_PARTITIONS];
+  pthread_t shard_threads[MAX_PARTITIONS];
+  workload.rings = NULL;
+  workload.write_ring = NULL;
+  pthread_t writer_thread;
+  if (config.writer) {
+    workload.write_ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(MpscRing));
+    mpsc_init(workload.write_ring);
+    workload.writer_running = 1;
+    pthread_create(&writer_thread, NULL, run_writer, &workload);
+  }
+  if (config.sharded) {
+    size_t rings_size = sizeof(SpscRing) * config.threads * config.partitions;
+    workload.rings = aligned_alloc(CACHE_LINE_SIZE, rings_size);
+    memset(workload.rings, 0, rings_size);
+    workload.shards_running = 1;
+    for (uint32_t i = 0; i < config.partitions; i++) {
+      shards[i] = (ShardThread){&workload, i};
+      pthread_create(&shard_threads[i], NULL, run_shard, &shards[i]);
+    }
+  }
+
+  uint64_t run_start = monotonic_ns();
+  for (uint32_t i = 0; i < config.threads; i++) {
+    pthread_create(&threads[i], NULL,
+                   config.sharded ? run_sharded_client : run_client,
+                   &clients[i]);
+  }
+  for (uint32_t i = 0; i < config.threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double run_seconds = (monotonic_ns() - run_start) / 1e9;
+  if (config.writer) {
+    __atomic_store_n(&workload.writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    free(workload.write_ring);
+  }
+  if (config.sharded) {
+    __atomic_store_n(&workload.shards_running, 0, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < config.partitions; i++) {
+      pthread_join(shard_threads[i], NULL);
+    }
+    free(workload.rings);
+  }
+  printf("run: %" PRIu64 " operations in %.3fs, %.0f ops/sec\n",
+         config.operations, run_seconds, config.operations / run_seconds);
+
+  Histogram* merged = calloc(OPERATION_TYPE_COUNT, sizeof(Histogram));
+  uint64_t not_found = 0;
+  for (uint32_t i = 0; i < config.threads; i++) {
+    for (uint32_t j = 0; j < OPERATION_TYPE_COUNT; j++) {
+      histogram_merge(&merged[j], &clients[i].latency[j]);
+    }
+    not_found += clients[i].not_found;
+  }
+  for (uint32_t j = 0; j < OPERATION_TYPE_COUNT; j++) {
+    if (merged[j].total_count > 0) {
+      write_histogram(stdout, operation_names[j], &merged[j]);
+    }
+  }
+  if (not_found > 0) {
+    printf("not_found: %" PRIu64 "\n", not_found);
+  }
+
+  db_close(workload.table);
+  if (config.filename == NULL) {
+    unlink_database(filename);
+    for (uint32_t i = 0; i < config.partitions; i++) {
+      char path[sizeof(filename) + 16];
+      sprintf(path, "%s-part%d", filename, i);
+      unlink_database(path);
+    }
+  }
+  free(merged);
+  free(clients);
+  free(threads);
+  free(workload.inserted);
+  return 0;
+}
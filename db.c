@@ -1,11 +1,19 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef struct {
   char* buffer;
@@ -16,6 +24,10 @@ typedef struct {
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_KEY_NOT_FOUND,
+  EXECUTE_READ_ONLY,
+  EXECUTE_UNRECOGNIZED_STATEMENT,
+  EXECUTE_TABLE_FULL,
 } ExecuteResult;
 
 typedef enum {
@@ -31,7 +43,12 @@ typedef enum {
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_UPDATE
+} StatementType;
+#define STATEMENT_TYPE_COUNT 3
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -41,9 +58,29 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+typedef enum { COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL } Column;
+
+typedef enum {
+  COMPARE_EQUAL,
+  COMPARE_LESS,
+  COMPARE_LESS_EQUAL,
+  COMPARE_GREATER,
+  COMPARE_GREATER_EQUAL
+} Comparison;
+
+/* A select's "where <column> <comparison> <value>" */
+typedef struct {
+  bool active;
+  Column column;
+  Comparison comparison;
+  uint32_t id;                       // for COLUMN_ID
+  char text[COLUMN_EMAIL_SIZE + 1];  // for the string columns
+} Predicate;
+
 typedef struct {
   StatementType type;
-  Row row_to_insert;  // only used by insert statement
+  Row row_to_insert;  // only used by insert and update statements
+  Predicate where;    // only used by select statements
 } Statement;
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
@@ -61,16 +98,340 @@ const uint32_t PAGE_SIZE = 4096;
 
 #define INVALID_PAGE_NUM UINT32_MAX
 
+/*
+HDR-style latency histogram over nanoseconds. Values are bucketed by their
+power of two, and each power is split into HISTOGRAM_SUB_BUCKETS linear
+sub-buckets, so the relative error is bounded at every magnitude while
+recording stays a couple of shifts and an increment.
+*/
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (64 - HISTOGRAM_SUB_BUCKET_BITS + 1)
+#define HISTOGRAM_COUNTS (HISTOGRAM_BUCKETS * HISTOGRAM_SUB_BUCKETS)
+#define LATENCY_DUMP_DEFAULT_INTERVAL 10
+
+typedef struct {
+  uint64_t total_count;
+  uint64_t max_value;
+  uint64_t counts[HISTOGRAM_COUNTS];
+} Histogram;
+
+/*
+Counters are bumped unconditionally on the hot paths, so keep them to
+plain increments. Anything that needs a tree walk (height, fill factor)
+is computed on demand by .stats instead.
+*/
+typedef struct {
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t pages_read;
+  uint64_t pages_written;
+  uint64_t pages_prefetched;  // written by the prefetch thread, atomically
+} PagerStats;
+
+/*
+Resident pages and how often they were used are saved next to the database
+in "<filename>-hot" on close, and read back in the background on the next
+open so the first queries don't all start with a cold cache.
+*/
+#define HOT_PAGES_MAGIC 0x504F4854  // "HTOP"
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t access_count;
+} HotPage;
+
+/*
+When page checksums are checked. On read, every page loaded from disk is
+verified before use. On scrub, reads trust the disk and corruption is only
+found by a scrub pass.
+*/
+typedef enum { CHECKSUM_VERIFY_ON_READ, CHECKSUM_VERIFY_ON_SCRUB } ChecksumMode;
+
 typedef struct {
   int file_descriptor;
-  uint32_t file_length;
+  uint32_t file_num_pages;  // pages that exist on disk
   uint32_t num_pages;
+  /*
+  Slots go from NULL to a page exactly once, and the prefetch thread may be
+  the one filling them, so they are read and filled with atomics
+  */
   void* pages[TABLE_MAX_PAGES];
+  uint32_t access_counts[TABLE_MAX_PAGES];
+  ChecksumMode checksum_mode;
+  uint64_t lsn;  // stamped on pages changed from now on
+  PagerStats stats;
+  Histogram flush_latency;
+  char* hot_pages_path;
+  HotPage* prefetch_list;
+  uint32_t prefetch_count;
+  pthread_t prefetch_thread;
+  bool prefetch_running;
 } Pager;
 
+/* Splits are bucketed by height above the leaves: 0 is a leaf split */
+#define STATS_MAX_LEVELS 16
+
+typedef struct {
+  uint64_t splits[STATS_MAX_LEVELS];
+  uint64_t rows_scanned;
+  uint64_t statements[STATEMENT_TYPE_COUNT];
+  /* B-epsilon engine only */
+  uint64_t buffer_flushes;
+  uint64_t leaf_batches;  // buffer flushes that reached a leaf
+  uint64_t leaf_batch_rows;
+  uint64_t index_lookups;  // point selects answered through the hash index
+  uint64_t bloom_negatives;  // lookups the table filter answered alone
+  uint64_t bloom_false_positives;
+  uint64_t leaves_skipped;  // by scans, thanks to the zone maps
+} TableStats;
+
+typedef struct {
+  Histogram prepare;
+  Histogram insert;
+  Histogram select;
+  Histogram update;
+  char* dump_path;  // NULL unless .latency dump was given a file
+  uint32_t dump_interval_seconds;
+  uint64_t last_dump_ns;
+} TableLatency;
+
+/*
+Background scrubbing of the file on disk. The thread only reads with pread
+into its own buffers, so it never touches the page cache the statements
+use. Results are published once per completed pass.
+*/
+#define SCRUB_DEFAULT_PAGES_PER_SECOND 100
+#define SCRUB_ERROR_SIZE 128
+/* A checker message with its "Page <n>: " prefix */
+#define SCRUB_PAGE_ERROR_SIZE (sizeof("Page 4294967295: ") + SCRUB_ERROR_SIZE)
+
+typedef struct {
+  pthread_t thread;
+  bool running;
+  bool stop;  // set by the foreground to end the thread, read atomically
+  uint32_t pages_per_second;
+  pthread_mutex_t lock;  // guards the results below
+  uint64_t passes;
+  uint64_t pages_checked;
+  uint32_t errors;  // found by the last completed pass
+  char last_error[SCRUB_PAGE_ERROR_SIZE];
+} Scrubber;
+
+/*
+An online backup into another database file. Pages are copied a few at a
+time between statements; any page changed after it was copied has a newer
+LSN by the time the backup finishes, and is copied again then. When the
+target already holds an older backup of the same database, only pages with
+an LSN above the target's are copied at all.
+*/
+#define BACKUP_PAGES_PER_STEP 16
+
+typedef struct {
+  char* path;
+  int file_descriptor;
+  uint64_t since_lsn;  // pages at or below this are already in the target
+  uint32_t next_page;
+  bool visited[TABLE_MAX_PAGES];
+  uint64_t copied_lsn[TABLE_MAX_PAGES];  // LSN of each visited page then
+  uint32_t pages_copied;
+  uint32_t pages_recopied;
+  uint32_t pages_unchanged;
+} Backup;
+
+typedef enum { ENGINE_BTREE, ENGINE_LSM, ENGINE_BETREE } Engine;
+
+/*
+How a leaf arranges its rows: one cell per row; PAX, one minipage per
+column; or dictionary, PAX with each string column stored once per distinct
+value. Each leaf records its own; LSM run blocks are always rows.
+*/
+typedef enum { LAYOUT_ROW, LAYOUT_PAX, LAYOUT_DICT } LeafLayout;
+
+/*
+How a partitioned table spreads its rows over its partitions: by a hash of
+the id, or by id range, partition i holding the ids from i times the width
+(the last one also holds everything past the end).
+*/
+typedef enum { PARTITION_NONE, PARTITION_HASH, PARTITION_RANGE } PartitionScheme;
+#define MAX_PARTITIONS 16
+
+/* Bloom filter over the ids, kept in a file of its own */
+typedef struct {
+  Pager* pager;
+  uint32_t num_blocks;
+  uint32_t num_keys;
+} TableBloom;
+
+/* Extendible hash index over the ids, kept in a file of its own */
+typedef struct {
+  Pager* pager;
+  uint32_t directory_page_num;
+  uint32_t num_keys;
+} HashIndex;
+
+/*
+Decoded rows for hot ids, so a repeated point select is one hash probe
+instead of a descent and a deserialize_row. The cache is split into shards
+with a lock each, and every shard evicts with CLOCK: a slot hit since the
+hand last passed it gets a second chance. Updates invalidate the id.
+*/
+#define ROW_CACHE_SHARDS 16
+
+typedef struct {
+  uint32_t key;
+  bool used;
+  bool referenced;
+  int32_t next;  // next slot in the same bucket, -1 at the end
+  Row row;
+} RowCacheSlot;
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t capacity;  // may be 0 when the cache has fewer rows than shards
+  uint32_t num_used;  // slots handed out so far, they never go back
+  uint32_t hand;
+  uint32_t num_buckets;
+  int32_t* buckets;  // first slot in each bucket
+  RowCacheSlot* slots;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} RowCacheShard;
+
+typedef struct {
+  uint32_t capacity;
+  RowCacheShard shards[ROW_CACHE_SHARDS];
+} RowCache;
+
+/*
+Output of recent selects, keyed by their predicate (so the query as parsed,
+not as typed) and stamped with the table's version. Every insert or update
+bumps the version, which makes all entries stale at once. Each predicate
+hashes to one slot, and a newer result simply takes the slot over.
+*/
+#define QUERY_CACHE_SLOTS 64
+#define QUERY_CACHE_MAX_RESULT_SIZE (1 << 20)
+
+typedef struct {
+  bool used;
+  Predicate where;
+  uint64_t version;
+  char* result;
+  size_t length;
+} QueryCacheEntry;
+
+typedef struct {
+  QueryCacheEntry entries[QUERY_CACHE_SLOTS];
+  uint64_t hits;
+  uint64_t misses;
+} QueryCache;
+
+/*
+Log shipping. A primary appends each insert and update it applies to
+"<db>-log", one fixed-size record per write. A follower tails another
+database's log and applies the records it hasn't seen between statements;
+it refuses writes of its own.
+*/
+typedef struct {
+  uint64_t lsn;         // 1 for the first record
+  uint64_t written_ns;  // realtime_ns() on the primary
+  uint32_t type;        // STATEMENT_INSERT or STATEMENT_UPDATE
+  Row row;
+} LogRecord;
+
+typedef enum { REPLICATION_PRIMARY, REPLICATION_FOLLOWER } ReplicationRole;
+
+typedef struct {
+  ReplicationRole role;
+  int file_descriptor;  // on the log
+  char* primary_path;   // the database a follower follows
+  uint64_t lsn;         // last record written, or applied by a follower
+  uint64_t lag_ns;      // from writing the last applied record to applying it
+} Replication;
+
+/*
+LSM engine. Writes go to a skiplist in memory; when it fills it is written
+out as an immutable sorted run, and runs of the same tier are merged into
+one run of the next tier a few rows at a time, as writes come in. Runs
+live in pager pages; see the LSM layouts below.
+*/
+#define LSM_MAX_RUNS 32
+#define LSM_SKIPLIST_MAX_LEVEL 12
+#define LSM_TIER_FANOUT 4
+#define LSM_MAX_SPACE_AMPLIFICATION 0.5
+#define LSM_COMPACTION_ROWS_PER_WRITE 16
+#define LSM_MEMTABLE_MAX_ROWS 64
+
+typedef struct MemtableNode {
+  uint32_t key;
+  void* value;  // ROW_SIZE bytes, allocated with the node
+  struct MemtableNode* next[];
+} MemtableNode;
+
+typedef struct {
+  MemtableNode* head;
+  uint32_t level;  // levels in use, at least 1
+  uint32_t num_rows;
+  uint64_t rng;
+} Memtable;
+
+/* A position in the memtable or in one run, for merging them in key order */
+typedef struct {
+  uint32_t run_page_num;  // INVALID_PAGE_NUM for the memtable
+  uint32_t block;
+  uint32_t cell;
+  MemtableNode* node;
+  bool done;
+} LsmSource;
+
+typedef struct {
+  bool active;
+  uint32_t num_inputs;
+  uint32_t inputs[LSM_MAX_RUNS];  // run pages, newest first
+  LsmSource sources[LSM_MAX_RUNS];
+  uint32_t output;  // run page being written
+} LsmCompaction;
+
 typedef struct {
+  Memtable memtable;
+  LsmCompaction compaction;
+  uint64_t rows_put;
+  uint64_t rows_written;  // into runs, by flushes and compactions
+  uint64_t flushes;
+  uint64_t compactions;
+  uint64_t bloom_skips;  // runs a lookup did not read thanks to the filter
+  uint32_t num_rows;     // distinct ids, counted on open, see LSM_MAX_ROWS
+} Lsm;
+
+typedef struct Table {
   Pager* pager;
-  uint32_t root_page_num;
+  uint32_t root_page_num;  // the LSM manifest page for that engine
+  TableStats stats;
+  TableLatency latency;
+  Scrubber scrub;
+  Backup* backup;  // NULL unless a backup is in progress
+  Lsm* lsm;        // NULL unless the table uses the LSM engine
+  bool betree;     // internal nodes buffer writes (B-epsilon engine)
+  HashIndex* index;  // NULL unless .index hash built one
+  char* index_path;
+  TableBloom* bloom;  // NULL unless .bloom on built one
+  char* bloom_path;
+  RowCache* row_cache;  // NULL unless .rowcache set a size
+  QueryCache* query_cache;  // NULL unless .querycache on
+  uint64_t version;  // bumped by every insert and update
+  void* value_buffer;  // rows gathered from PAX leaves, see table_get
+  Replication* replication;  // NULL unless .primary or .follow
+  char* log_path;
+  char* filename;
+  /*
+  A partitioned table keeps its rows in other database files, one per
+  partition, and its own tree stays empty
+  */
+  PartitionScheme partition_scheme;
+  uint32_t partition_width;
+  uint32_t num_partitions;  // 0 unless partitioned
+  struct Table** partitions;
 } Table;
 
 typedef struct {
@@ -78,13 +439,187 @@ typedef struct {
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;  // Indicates a position one past the last element
+  /* LSM engine only: one source per run plus the memtable */
+  bool lsm;
+  uint32_t num_sources;
+  uint32_t current;  // source holding the row at the cursor
+  LsmSource sources[LSM_MAX_RUNS + 1];
 } Cursor;
 
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+/*
+Static tracepoints, compiled in only with -DNOTTOSQL_TRACE (make db-trace).
+
+With <sys/sdt.h> available they are USDT probes in the "nottosql" provider:
+  bpftrace -e 'usdt:./db-trace:nottosql:page_miss { @[arg0] = count(); }'
+Without it each probe is a tiny non-inlined trace_<name> function whose
+arguments can be read through a uprobe:
+  bpftrace -e 'uprobe:./db-trace:trace_page_miss { @[arg0] = count(); }'
+In the default build TRACE expands to nothing, arguments included.
+*/
+#if defined(NOTTOSQL_TRACE) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE(probe, ...) STAP_PROBEV(nottosql, probe, __VA_ARGS__)
+#elif defined(NOTTOSQL_TRACE)
+#define TRACE(probe, ...) trace_##probe(__VA_ARGS__)
+#define TRACE_FUNCTION __attribute__((noinline, used)) void
+TRACE_FUNCTION trace_page_miss(uint32_t page_num) {
+  __asm__ volatile("" : : "r"(page_num) : "memory");
+}
+TRACE_FUNCTION trace_page_read_done(uint32_t page_num, int64_t bytes_read) {
+  __asm__ volatile("" : : "r"(page_num), "r"(bytes_read) : "memory");
+}
+TRACE_FUNCTION trace_page_flush_start(uint32_t page_num) {
+  __asm__ volatile("" : : "r"(page_num) : "memory");
+}
+TRACE_FUNCTION trace_page_flush_done(uint32_t page_num) {
+  __asm__ volatile("" : : "r"(page_num) : "memory");
+}
+TRACE_FUNCTION trace_leaf_split(uint32_t page_num, uint32_t new_page_num) {
+  __asm__ volatile("" : : "r"(page_num), "r"(new_page_num) : "memory");
+}
+TRACE_FUNCTION trace_internal_split(uint32_t page_num, uint32_t new_page_num,
+                                    uint32_t level) {
+  __asm__ volatile(""
+                   :
+                   : "r"(page_num), "r"(new_page_num), "r"(level)
+                   : "memory");
+}
+TRACE_FUNCTION trace_new_root(uint32_t left_child_page_num,
+                              uint32_t right_child_page_num) {
+  __asm__ volatile(""
+                   :
+                   : "r"(left_child_page_num), "r"(right_child_page_num)
+                   : "memory");
+}
+TRACE_FUNCTION trace_statement_start(uint32_t type) {
+  __asm__ volatile("" : : "r"(type) : "memory");
+}
+TRACE_FUNCTION trace_statement_done(uint32_t type, uint32_t result) {
+  __asm__ volatile("" : : "r"(type), "r"(result) : "memory");
+}
+#else
+#define TRACE(probe, ...) \
+  do {                    \
+  } while (0)
+#endif
+
+uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Wall clock time, comparable between processes and machines */
+uint64_t realtime_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint32_t histogram_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  uint32_t exponent = 63 - __builtin_clzll(value);
+  uint32_t shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+  uint32_t bucket = shift + 1;
+  uint32_t sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return bucket * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/* Largest value that lands in the same slot, as HdrHistogram reports it */
+uint64_t histogram_value_at_index(uint32_t index) {
+  uint32_t bucket = index / HISTOGRAM_SUB_BUCKETS;
+  uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+  if (bucket == 0) {
+    return sub_bucket;
+  }
+  uint32_t shift = bucket - 1;
+  uint64_t lowest = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+  return lowest + ((1ULL << shift) - 1);
+}
+
+void histogram_record(Histogram* histogram, uint64_t value) {
+  histogram->counts[histogram_index(value)]++;
+  histogram->total_count++;
+  if (value > histogram->max_value) {
+    histogram->max_value = value;
+  }
+}
+
+uint64_t histogram_percentile(Histogram* histogram, double percentile) {
+  if (histogram->total_count == 0) {
+    return 0;
+  }
+  double exact = percentile / 100.0 * histogram->total_count;
+  uint64_t target = (uint64_t)exact;
+  if (target < exact || target == 0) {
+    target++;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_COUNTS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= target) {
+      uint64_t value = histogram_value_at_index(i);
+      return value < histogram->max_value ? value : histogram->max_value;
+    }
+  }
+  return histogram->max_value;
+}
+
+void write_histogram(FILE* out, const char* name, Histogram* histogram) {
+  fprintf(out,
+          "%s: count=%" PRIu64 " p50=%" PRIu64 "ns p99=%" PRIu64
+          "ns p999=%" PRIu64 "ns max=%" PRIu64 "ns\n",
+          name, histogram->total_count, histogram_percentile(histogram, 50.0),
+          histogram_percentile(histogram, 99.0),
+          histogram_percentile(histogram, 99.9), histogram->max_value);
+}
+
+/* A select's output, built up and written in one go */
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+} ResultBuffer;
+
+void result_buffer_reserve(ResultBuffer* out, size_t length) {
+  size_t needed = out->length + length;
+  if (needed > out->capacity) {
+    out->capacity = needed > out->capacity * 2 ? needed : out->capacity * 2;
+    out->data = realloc(out->data, out->capacity);
+  }
+}
+
+void result_buffer_append(ResultBuffer* out, const char* data, size_t length) {
+  result_buffer_reserve(out, length);
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+}
+
+void print_row(ResultBuffer* out, Row* row) {
+  /* Both strings are NUL terminated within the row */
+  result_buffer_reserve(out, sizeof(Row) + 16);
+  out->length += sprintf(out->data + out->length, "(%d, %s, %s)\n", row->id,
+                         row->username, row->email);
 }
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum {
+  NODE_INTERNAL,
+  NODE_LEAF,
+  NODE_LSM_MANIFEST,
+  NODE_LSM_RUN
+} NodeType;
+
+/*
+ * Page Trailer Layout
+ * The last bytes of every page on disk, whatever the page holds.
+ */
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = PAGE_SIZE - PAGE_CHECKSUM_SIZE;
+const uint32_t PAGE_LSN_SIZE = sizeof(uint64_t);
+const uint32_t PAGE_LSN_OFFSET = PAGE_CHECKSUM_OFFSET - PAGE_LSN_SIZE;
+const uint32_t PAGE_TRAILER_SIZE = PAGE_LSN_SIZE + PAGE_CHECKSUM_SIZE;
 
 /*
  * Common Node Header Layout
@@ -106,9 +641,13 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_BUFFER_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_BUFFER_COUNT_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                            INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE +
+                                           INTERNAL_NODE_BUFFER_COUNT_SIZE;
 
 /*
  * Internal Node Body Layout
@@ -120,6 +659,47 @@ const uint32_t INTERNAL_NODE_CELL_SIZE =
 /* Keep this small for testing */
 const uint32_t INTERNAL_NODE_MAX_KEYS = 3;
 
+/*
+ * Internal Node Buffer Layout (B-epsilon engine)
+ * Rows waiting to be flushed to the children, sorted by key, filling the
+ * rest of the page. A split briefly holds one cell over the maximum.
+ */
+const uint32_t INTERNAL_NODE_BUFFER_OFFSET =
+    INTERNAL_NODE_HEADER_SIZE +
+    (INTERNAL_NODE_MAX_KEYS + 1) * INTERNAL_NODE_CELL_SIZE;
+const uint32_t BUFFER_MESSAGE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t BUFFER_MESSAGE_SIZE = BUFFER_MESSAGE_KEY_SIZE + ROW_SIZE;
+const uint32_t INTERNAL_NODE_BUFFER_MAX_MESSAGES =
+    (PAGE_SIZE - PAGE_TRAILER_SIZE - INTERNAL_NODE_BUFFER_OFFSET) /
+    BUFFER_MESSAGE_SIZE;
+
+/*
+ * Hash Index Directory Layout
+ * Slot i holds the bucket for keys whose hash ends in the bits of i.
+ */
+#define HASH_INDEX_MAX_DEPTH 9
+const uint32_t HASH_DIRECTORY_DEPTH_SIZE = sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_DEPTH_OFFSET = 0;
+const uint32_t HASH_DIRECTORY_SLOTS_OFFSET =
+    HASH_DIRECTORY_DEPTH_OFFSET + HASH_DIRECTORY_DEPTH_SIZE;
+
+/*
+ * Hash Index Bucket Layout
+ * (key, leaf page) pairs sorted by key.
+ */
+const uint32_t HASH_BUCKET_DEPTH_SIZE = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_DEPTH_OFFSET = 0;
+const uint32_t HASH_BUCKET_NUM_ENTRIES_SIZE = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_NUM_ENTRIES_OFFSET =
+    HASH_BUCKET_DEPTH_OFFSET + HASH_BUCKET_DEPTH_SIZE;
+const uint32_t HASH_BUCKET_HEADER_SIZE =
+    HASH_BUCKET_DEPTH_SIZE + HASH_BUCKET_NUM_ENTRIES_SIZE;
+const uint32_t HASH_ENTRY_KEY_SIZE = sizeof(uint32_t);
+const uint32_t HASH_ENTRY_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HASH_ENTRY_SIZE = HASH_ENTRY_KEY_SIZE + HASH_ENTRY_PAGE_SIZE;
+const uint32_t HASH_BUCKET_MAX_ENTRIES =
+    (PAGE_SIZE - PAGE_TRAILER_SIZE - HASH_BUCKET_HEADER_SIZE) / HASH_ENTRY_SIZE;
+
 /*
  * Leaf Node Header Layout
  */
@@ -128,9 +708,21 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_LAYOUT_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_LAYOUT_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+/*
+The zone map: the smallest and largest username, then email, in the leaf,
+cut to their first ZONE_PREFIX_SIZE bytes. Writes only ever widen it, a
+split recomputes it. LSM run blocks don't keep one.
+*/
+#define ZONE_PREFIX_SIZE 8
+const uint32_t LEAF_NODE_ZONE_SIZE = 4 * ZONE_PREFIX_SIZE;
+const uint32_t LEAF_NODE_ZONE_OFFSET =
+    LEAF_NODE_LAYOUT_OFFSET + LEAF_NODE_LAYOUT_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_LAYOUT_SIZE + LEAF_NODE_ZONE_SIZE;
 
 /*
  * Leaf Node Body Layout
@@ -141,13 +733,310 @@ const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET =
     LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS =
+    PAGE_SIZE - LEAF_NODE_HEADER_SIZE - PAGE_TRAILER_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS =
     LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
 const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
     (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
+/*
+ * Leaf Node PAX Body Layout
+ * The same rows, a minipage per column: all the ids, which are also the
+ * keys, then all the usernames, then all the emails.
+ */
+const uint32_t LEAF_NODE_PAX_IDS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_PAX_USERNAMES_OFFSET =
+    LEAF_NODE_PAX_IDS_OFFSET + LEAF_NODE_MAX_CELLS * ID_SIZE;
+const uint32_t LEAF_NODE_PAX_EMAILS_OFFSET =
+    LEAF_NODE_PAX_USERNAMES_OFFSET + LEAF_NODE_MAX_CELLS * USERNAME_SIZE;
+
+/*
+ * Leaf Node Dictionary Body Layout
+ * The ids as in PAX, then a one-byte code per cell for the username and
+ * for the email, then each column's dictionary: how many entries it has,
+ * then the distinct values the codes index. A dictionary has room for a
+ * distinct value per cell, so the page is no smaller than a row leaf.
+ */
+const uint32_t LEAF_NODE_DICT_CODE_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_NODE_DICT_CODES_OFFSET = LEAF_NODE_PAX_USERNAMES_OFFSET;
+const uint32_t LEAF_NODE_DICT_NUM_ENTRIES_OFFSET =
+    LEAF_NODE_DICT_CODES_OFFSET +
+    2 * LEAF_NODE_MAX_CELLS * LEAF_NODE_DICT_CODE_SIZE;
+const uint32_t LEAF_NODE_DICT_USERNAMES_OFFSET =
+    LEAF_NODE_DICT_NUM_ENTRIES_OFFSET + 2 * sizeof(uint8_t);
+const uint32_t LEAF_NODE_DICT_EMAILS_OFFSET =
+    LEAF_NODE_DICT_USERNAMES_OFFSET + LEAF_NODE_MAX_CELLS * USERNAME_SIZE;
+
+/*
+ * LSM Manifest Layout
+ * The root page of an LSM table: its runs, newest first, and the pages
+ * freed by compaction, ready for reuse.
+ */
+const uint32_t LSM_MANIFEST_NUM_RUNS_SIZE = sizeof(uint32_t);
+const uint32_t LSM_MANIFEST_NUM_RUNS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LSM_MANIFEST_NUM_FREE_SIZE = sizeof(uint32_t);
+const uint32_t LSM_MANIFEST_NUM_FREE_OFFSET =
+    LSM_MANIFEST_NUM_RUNS_OFFSET + LSM_MANIFEST_NUM_RUNS_SIZE;
+const uint32_t LSM_MANIFEST_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                          LSM_MANIFEST_NUM_RUNS_SIZE +
+                                          LSM_MANIFEST_NUM_FREE_SIZE;
+const uint32_t LSM_MANIFEST_RUNS_OFFSET = LSM_MANIFEST_HEADER_SIZE;
+const uint32_t LSM_MANIFEST_FREE_OFFSET =
+    LSM_MANIFEST_RUNS_OFFSET + LSM_MAX_RUNS * sizeof(uint32_t);
+
+/*
+ * LSM Run Layout
+ * One page per sorted run. Its rows are in leaf node pages ("blocks"), in
+ * key order; the run page lists them with the largest key of each, then
+ * holds a bloom filter over every key in the run.
+ */
+#define LSM_RUN_MAX_BLOCKS 128
+const uint32_t LSM_RUN_NUM_BLOCKS_SIZE = sizeof(uint32_t);
+const uint32_t LSM_RUN_NUM_BLOCKS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LSM_RUN_NUM_ROWS_SIZE = sizeof(uint32_t);
+const uint32_t LSM_RUN_NUM_ROWS_OFFSET =
+    LSM_RUN_NUM_BLOCKS_OFFSET + LSM_RUN_NUM_BLOCKS_SIZE;
+const uint32_t LSM_RUN_TIER_SIZE = sizeof(uint32_t);
+const uint32_t LSM_RUN_TIER_OFFSET =
+    LSM_RUN_NUM_ROWS_OFFSET + LSM_RUN_NUM_ROWS_SIZE;
+const uint32_t LSM_RUN_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                     LSM_RUN_NUM_BLOCKS_SIZE +
+                                     LSM_RUN_NUM_ROWS_SIZE + LSM_RUN_TIER_SIZE;
+const uint32_t LSM_RUN_BLOCK_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t LSM_RUN_BLOCK_MAX_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LSM_RUN_BLOCK_SIZE =
+    LSM_RUN_BLOCK_PAGE_SIZE + LSM_RUN_BLOCK_MAX_KEY_SIZE;
+/*
+A merge may put every row of the table into one run, so an LSM table holds
+no more distinct ids than a run has room for. Inserts past it are refused.
+*/
+const uint32_t LSM_MAX_ROWS = LSM_RUN_MAX_BLOCKS * LEAF_NODE_MAX_CELLS;
+/* Filter blocks start on a cache line, so none straddles two */
+#define BLOOM_BLOCK_WORDS 8
+const uint32_t BLOOM_BLOCK_SIZE = BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+#define CACHE_LINE_SIZE 64
+const uint32_t LSM_RUN_BLOOM_OFFSET =
+    (LSM_RUN_HEADER_SIZE + LSM_RUN_MAX_BLOCKS * LSM_RUN_BLOCK_SIZE +
+     CACHE_LINE_SIZE - 1) /
+    CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+const uint32_t LSM_RUN_BLOOM_BLOCKS =
+    (PAGE_SIZE - PAGE_TRAILER_SIZE - LSM_RUN_BLOOM_OFFSET) / BLOOM_BLOCK_SIZE;
+
+/*
+ * Table Bloom Filter Layout
+ * In <db>-bloom. Page 1 says how big the filter is; the blocks follow from
+ * page 2 on, a whole number of them per page.
+ */
+const uint32_t BLOOM_NUM_BLOCKS_OFFSET = 0;
+const uint32_t BLOOM_NUM_KEYS_OFFSET = sizeof(uint32_t);
+const uint32_t BLOOM_BLOCKS_PER_PAGE =
+    (PAGE_SIZE - PAGE_TRAILER_SIZE) / BLOOM_BLOCK_SIZE;
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_MIN_KEYS 1024
+
+/*
+ * Database Header Layout
+ * Page 0 of every file. Only this page is read when the file is opened;
+ * it says how many pages follow and where the tree starts.
+ */
+#define DB_MAGIC 0x6F74746E  // "ntto"
+#define DB_FORMAT_VERSION 9
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PAGE_SIZE_OFFSET =
+    HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE;
+const uint32_t HEADER_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_PAGES_OFFSET =
+    HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE;
+const uint32_t HEADER_DB_ID_SIZE = sizeof(uint64_t);
+const uint32_t HEADER_DB_ID_OFFSET =
+    HEADER_NUM_PAGES_OFFSET + HEADER_NUM_PAGES_SIZE;
+const uint32_t HEADER_LSN_SIZE = sizeof(uint64_t);
+const uint32_t HEADER_LSN_OFFSET = HEADER_DB_ID_OFFSET + HEADER_DB_ID_SIZE;
+const uint32_t HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_LSN_OFFSET + HEADER_LSN_SIZE;
+const uint32_t HEADER_ENGINE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ENGINE_OFFSET =
+    HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE;
+const uint32_t HEADER_LAYOUT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_LAYOUT_OFFSET =
+    HEADER_ENGINE_OFFSET + HEADER_ENGINE_SIZE;
+const uint32_t HEADER_PARTITION_SCHEME_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PARTITION_SCHEME_OFFSET =
+    HEADER_LAYOUT_OFFSET + HEADER_LAYOUT_SIZE;
+const uint32_t HEADER_NUM_PARTITIONS_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_PARTITIONS_OFFSET =
+    HEADER_PARTITION_SCHEME_OFFSET + HEADER_PARTITION_SCHEME_SIZE;
+const uint32_t HEADER_PARTITION_WIDTH_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PARTITION_WIDTH_OFFSET =
+    HEADER_NUM_PARTITIONS_OFFSET + HEADER_NUM_PARTITIONS_SIZE;
+const uint32_t HEADER_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_CHECKSUM_OFFSET =
+    HEADER_PARTITION_WIDTH_OFFSET + HEADER_PARTITION_WIDTH_SIZE;
+
+uint32_t* header_magic(void* header) { return header + HEADER_MAGIC_OFFSET; }
+
+uint32_t* header_version(void* header) {
+  return header + HEADER_VERSION_OFFSET;
+}
+
+uint32_t* header_page_size(void* header) {
+  return header + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* header_num_pages(void* header) {
+  return header + HEADER_NUM_PAGES_OFFSET;
+}
+
+/* Random, set when the file is created. Backups keep it. */
+uint64_t* header_db_id(void* header) { return header + HEADER_DB_ID_OFFSET; }
+
+/* Every page changed after the file was closed gets a higher LSN than this */
+uint64_t* header_lsn(void* header) { return header + HEADER_LSN_OFFSET; }
+
+uint32_t* header_root_page_num(void* header) {
+  return header + HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* header_engine(void* header) {
+  return header + HEADER_ENGINE_OFFSET;
+}
+
+/* The LeafLayout new leaves get */
+uint32_t* header_layout(void* header) {
+  return header + HEADER_LAYOUT_OFFSET;
+}
+
+uint32_t* header_partition_scheme(void* header) {
+  return header + HEADER_PARTITION_SCHEME_OFFSET;
+}
+
+/* 0 unless the rows live in partition files */
+uint32_t* header_num_partitions(void* header) {
+  return header + HEADER_NUM_PARTITIONS_OFFSET;
+}
+
+/* Ids per partition, for range partitioning */
+uint32_t* header_partition_width(void* header) {
+  return header + HEADER_PARTITION_WIDTH_OFFSET;
+}
+
+uint32_t* header_checksum(void* header) {
+  return header + HEADER_CHECKSUM_OFFSET;
+}
+
+/*
+CRC32C (Castagnoli), reflected. x86-64 CPUs with SSE4.2 have an instruction
+for it that takes 8 bytes at a time, a page costs a few hundred cycles.
+Elsewhere a table lookup per byte does the same sum.
+*/
+uint32_t crc32c_table[256];
+bool crc32c_ready = false;
+bool crc32c_hardware = false;
+
+/* Called from pager_open, before any background thread can checksum */
+void crc32c_init() {
+  if (crc32c_ready) {
+    return;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+  crc32c_ready = true;
+}
+
+uint32_t crc32c_software(const void* data, size_t length) {
+  const uint8_t* bytes = data;
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(const void* data,
+                                                        size_t length) {
+  const uint8_t* bytes = data;
+  uint64_t crc = 0xFFFFFFFF;
+  while (length >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(uint64_t));
+    crc = _mm_crc32_u64(crc, word);
+    bytes += sizeof(uint64_t);
+    length -= sizeof(uint64_t);
+  }
+  uint32_t crc32 = (uint32_t)crc;
+  while (length > 0) {
+    crc32 = _mm_crc32_u8(crc32, *bytes);
+    bytes++;
+    length--;
+  }
+  return ~crc32;
+}
+#endif
+
+uint32_t crc32c(const void* data, size_t length) {
+  crc32c_init();
+#if defined(__x86_64__)
+  if (crc32c_hardware) {
+    return crc32c_sse42(data, length);
+  }
+#endif
+  return crc32c_software(data, length);
+}
+
+uint32_t* page_checksum(void* page) { return page + PAGE_CHECKSUM_OFFSET; }
+
+void update_page_checksum(void* page) {
+  *page_checksum(page) = crc32c(page, PAGE_CHECKSUM_OFFSET);
+}
+
+bool page_checksum_valid(void* page) {
+  return *page_checksum(page) == crc32c(page, PAGE_CHECKSUM_OFFSET);
+}
+
+/* The trailer LSN is not 8-byte aligned, so it is copied in and out */
+uint64_t get_page_lsn(void* page) {
+  uint64_t lsn;
+  memcpy(&lsn, page + PAGE_LSN_OFFSET, PAGE_LSN_SIZE);
+  return lsn;
+}
+
+void set_page_lsn(void* page, uint64_t lsn) {
+  memcpy(page + PAGE_LSN_OFFSET, &lsn, PAGE_LSN_SIZE);
+}
+
+void initialize_header(void* header) {
+  memset(header, 0, PAGE_SIZE);
+  *header_magic(header) = DB_MAGIC;
+  *header_version(header) = DB_FORMAT_VERSION;
+  *header_page_size(header) = PAGE_SIZE;
+  *header_num_pages(header) = 0;
+  *header_db_id(header) =
+      ((uint64_t)time(NULL) << 32) ^ monotonic_ns() ^ (uint64_t)getpid();
+  *header_lsn(header) = 1;
+  *header_root_page_num(header) = INVALID_PAGE_NUM;
+  *header_engine(header) = ENGINE_BTREE;
+}
+
+void update_header_checksum(void* header) {
+  *header_checksum(header) = crc32c(header, HEADER_CHECKSUM_OFFSET);
+}
+
 NodeType get_node_type(void* node) {
   uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
   return (NodeType)value;
@@ -178,6 +1067,46 @@ uint32_t* internal_node_right_child(void* node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
+uint32_t* hash_directory_depth(void* node) {
+  return node + HASH_DIRECTORY_DEPTH_OFFSET;
+}
+
+uint32_t* hash_directory_slot(void* node, uint32_t slot) {
+  return node + HASH_DIRECTORY_SLOTS_OFFSET + slot * sizeof(uint32_t);
+}
+
+uint32_t* hash_bucket_depth(void* node) {
+  return node + HASH_BUCKET_DEPTH_OFFSET;
+}
+
+uint32_t* hash_bucket_num_entries(void* node) {
+  return node + HASH_BUCKET_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t* hash_bucket_key(void* node, uint32_t entry) {
+  return node + HASH_BUCKET_HEADER_SIZE + entry * HASH_ENTRY_SIZE;
+}
+
+uint32_t* hash_bucket_page(void* node, uint32_t entry) {
+  return (void*)hash_bucket_key(node, entry) + HASH_ENTRY_KEY_SIZE;
+}
+
+uint32_t* internal_node_buffer_count(void* node) {
+  return node + INTERNAL_NODE_BUFFER_COUNT_OFFSET;
+}
+
+void* internal_node_message(void* node, uint32_t message_num) {
+  return node + INTERNAL_NODE_BUFFER_OFFSET + message_num * BUFFER_MESSAGE_SIZE;
+}
+
+uint32_t* internal_node_message_key(void* node, uint32_t message_num) {
+  return internal_node_message(node, message_num);
+}
+
+void* internal_node_message_value(void* node, uint32_t message_num) {
+  return internal_node_message(node, message_num) + BUFFER_MESSAGE_KEY_SIZE;
+}
+
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
   return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
 }
@@ -216,54 +1145,402 @@ uint32_t* leaf_node_next_leaf(void* node) {
   return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t* leaf_node_layout(void* node) {
+  return node + LEAF_NODE_LAYOUT_OFFSET;
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+bool leaf_node_is_pax(void* node) {
+  return *leaf_node_layout(node) == LAYOUT_PAX;
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+bool leaf_node_is_dict(void* node) {
+  return *leaf_node_layout(node) == LAYOUT_DICT;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
+/* The dictionary helpers are for the username and email columns */
+uint8_t* leaf_node_dict_code(void* node, uint32_t cell_num, Column column) {
+  uint32_t index = column == COLUMN_USERNAME ? 0 : 1;
+  return node + LEAF_NODE_DICT_CODES_OFFSET +
+         (index * LEAF_NODE_MAX_CELLS + cell_num) * LEAF_NODE_DICT_CODE_SIZE;
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+uint8_t* leaf_node_dict_num_entries(void* node, Column column) {
+  uint32_t index = column == COLUMN_USERNAME ? 0 : 1;
+  return node + LEAF_NODE_DICT_NUM_ENTRIES_OFFSET + index * sizeof(uint8_t);
+}
 
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+char* leaf_node_dict_entry(void* node, Column column, uint32_t code) {
+  if (column == COLUMN_USERNAME) {
+    return node + LEAF_NODE_DICT_USERNAMES_OFFSET + code * USERNAME_SIZE;
+  }
+  return node + LEAF_NODE_DICT_EMAILS_OFFSET + code * EMAIL_SIZE;
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
+/*
+Drops the entries no cell but skip_cell uses and renumbers the rest. Every
+cell slot is counted, in use or not, since shifting cells may leave live
+codes past num_cells; that still frees at least one entry.
+*/
+void leaf_node_dict_compact(void* node, Column column, uint32_t skip_cell) {
+  uint32_t num_entries = *leaf_node_dict_num_entries(node, column);
+  uint32_t size = column == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE;
+  bool used[LEAF_NODE_MAX_CELLS];
+  uint8_t renumbered[LEAF_NODE_MAX_CELLS];
+  memset(used, 0, sizeof(used));
+  for (uint32_t i = 0; i < LEAF_NODE_MAX_CELLS; i++) {
+    uint8_t code = *leaf_node_dict_code(node, i, column);
+    if (i != skip_cell && code < num_entries) {
+      used[code] = true;
+    }
+  }
+  uint32_t kept = 0;
+  for (uint32_t code = 0; code < num_entries; code++) {
+    if (!used[code]) {
+      continue;
+    }
+    if (kept != code) {
+      memcpy(leaf_node_dict_entry(node, column, kept),
+             leaf_node_dict_entry(node, column, code), size);
+    }
+    renumbered[code] = kept++;
+  }
+  for (uint32_t i = 0; i < LEAF_NODE_MAX_CELLS; i++) {
+    uint8_t* code = leaf_node_dict_code(node, i, column);
+    *code = *code < num_entries && used[*code] ? renumbered[*code] : 0;
+  }
+  *leaf_node_dict_num_entries(node, column) = kept;
+}
+
+/* The value's code, adding it to the dictionary if it is new */
+uint8_t leaf_node_dict_intern(void* node, uint32_t cell_num, Column column,
+                              const char* value) {
+  uint8_t* num_entries = leaf_node_dict_num_entries(node, column);
+  for (uint32_t code = 0; code < *num_entries; code++) {
+    if (strcmp(leaf_node_dict_entry(node, column, code), value) == 0) {
+      return code;
+    }
+  }
+  if (*num_entries == LEAF_NODE_MAX_CELLS) {
+    leaf_node_dict_compact(node, column, cell_num);
+  }
+  memcpy(leaf_node_dict_entry(node, column, *num_entries), value,
+         column == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE);
+  return (*num_entries)++;
+}
+
+void leaf_node_set_layout(void* node, LeafLayout layout) {
+  *leaf_node_layout(node) = layout;
+  if (layout == LAYOUT_DICT) {
+    *leaf_node_dict_num_entries(node, COLUMN_USERNAME) = 0;
+    *leaf_node_dict_num_entries(node, COLUMN_EMAIL) = 0;
+  }
+}
+
+typedef enum { ZONE_MIN, ZONE_MAX } ZoneBound;
+
+/* For the username and email columns */
+char* leaf_node_zone(void* node, Column column, ZoneBound bound) {
+  uint32_t index = column == COLUMN_USERNAME ? 0 : 2;
+  return node + LEAF_NODE_ZONE_OFFSET + (index + bound) * ZONE_PREFIX_SIZE;
+}
+
+void leaf_node_zone_clear(void* node) {
+  memset(leaf_node_zone(node, COLUMN_USERNAME, ZONE_MIN), 0xFF,
+         ZONE_PREFIX_SIZE);
+  memset(leaf_node_zone(node, COLUMN_USERNAME, ZONE_MAX), 0, ZONE_PREFIX_SIZE);
+  memset(leaf_node_zone(node, COLUMN_EMAIL, ZONE_MIN), 0xFF, ZONE_PREFIX_SIZE);
+  memset(leaf_node_zone(node, COLUMN_EMAIL, ZONE_MAX), 0, ZONE_PREFIX_SIZE);
+}
+
+void zone_widen(void* node, Column column, const char* value) {
+  char* min = leaf_node_zone(node, column, ZONE_MIN);
+  char* max = leaf_node_zone(node, column, ZONE_MAX);
+  if (strncmp(value, min, ZONE_PREFIX_SIZE) < 0) {
+    strncpy(min, value, ZONE_PREFIX_SIZE);
+  }
+  if (strncmp(value, max, ZONE_PREFIX_SIZE) > 0) {
+    strncpy(max, value, ZONE_PREFIX_SIZE);
+  }
+}
+
+void leaf_node_zone_widen(void* node, const char* username,
+                          const char* email) {
+  zone_widen(node, COLUMN_USERNAME, username);
+  zone_widen(node, COLUMN_EMAIL, email);
+}
+
+/*
+False when, going by the zone map, no row in the leaf can match. Prefixes
+only rule a leaf out when they differ from the value within their length.
+*/
+bool leaf_node_may_match(void* node, Predicate* where) {
+  if (!where->active || where->column == COLUMN_ID) {
+    return true;
+  }
+  bool min_below = strncmp(leaf_node_zone(node, where->column, ZONE_MIN),
+                           where->text, ZONE_PREFIX_SIZE) <= 0;
+  bool max_above = strncmp(leaf_node_zone(node, where->column, ZONE_MAX),
+                           where->text, ZONE_PREFIX_SIZE) >= 0;
+  switch (where->comparison) {
+    case COMPARE_EQUAL:
+      return min_below && max_above;
+    case COMPARE_LESS:
+    case COMPARE_LESS_EQUAL:
+      return min_below;
+    case COMPARE_GREATER:
+    case COMPARE_GREATER_EQUAL:
+      return max_above;
+  }
+  return true;
+}
+
+/* Row layout only, like leaf_node_value */
+void* leaf_node_cell(void* node, uint32_t cell_num) {
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+  if (*leaf_node_layout(node) != LAYOUT_ROW) {
+    return node + LEAF_NODE_PAX_IDS_OFFSET + cell_num * ID_SIZE;
+  }
+  return leaf_node_cell(node, cell_num);
+}
+
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+/* One column of the cell's row, stored as serialize_row stores it */
+void* leaf_node_column(void* node, uint32_t cell_num, Column column) {
+  if (leaf_node_is_dict(node)) {
+    if (column == COLUMN_ID) {
+      return node + LEAF_NODE_PAX_IDS_OFFSET + cell_num * ID_SIZE;
+    }
+    return leaf_node_dict_entry(node, column,
+                                *leaf_node_dict_code(node, cell_num, column));
+  }
+  if (leaf_node_is_pax(node)) {
+    switch (column) {
+      case COLUMN_ID:
+        return node + LEAF_NODE_PAX_IDS_OFFSET + cell_num * ID_SIZE;
+      case COLUMN_USERNAME:
+        return node + LEAF_NODE_PAX_USERNAMES_OFFSET +
+               cell_num * USERNAME_SIZE;
+      case COLUMN_EMAIL:
+        return node + LEAF_NODE_PAX_EMAILS_OFFSET + cell_num * EMAIL_SIZE;
+    }
+  }
+  void* value = leaf_node_value(node, cell_num);
+  switch (column) {
+    case COLUMN_ID:
+      return value + ID_OFFSET;
+    case COLUMN_USERNAME:
+      return value + USERNAME_OFFSET;
+    case COLUMN_EMAIL:
+      return value + EMAIL_OFFSET;
+  }
+  return value;
+}
+
+/*
+Bytes from one cell's value in a column to the next one's. Dictionary
+leaves only have one for the ids; their strings are reached through codes.
+*/
+uint32_t leaf_node_column_stride(void* node, Column column) {
+  if (*leaf_node_layout(node) == LAYOUT_ROW) {
+    return LEAF_NODE_CELL_SIZE;
+  }
+  switch (column) {
+    case COLUMN_ID:
+      return ID_SIZE;
+    case COLUMN_USERNAME:
+      return USERNAME_SIZE;
+    case COLUMN_EMAIL:
+      return EMAIL_SIZE;
+  }
+  return 0;
+}
+
+/*
+The cell's row as serialize_row lays it out. Row layout leaves hand out a
+pointer into the page; PAX and dictionary leaves gather the columns into
+buffer first.
+*/
+void* leaf_node_row(void* node, uint32_t cell_num, void* buffer) {
+  if (*leaf_node_layout(node) == LAYOUT_ROW) {
+    return leaf_node_value(node, cell_num);
+  }
+  memcpy(buffer + ID_OFFSET, leaf_node_column(node, cell_num, COLUMN_ID),
+         ID_SIZE);
+  memcpy(buffer + USERNAME_OFFSET,
+         leaf_node_column(node, cell_num, COLUMN_USERNAME), USERNAME_SIZE);
+  memcpy(buffer + EMAIL_OFFSET, leaf_node_column(node, cell_num, COLUMN_EMAIL),
+         EMAIL_SIZE);
+  return buffer;
+}
+
+/* The string columns of a PAX or dictionary leaf's cell */
+void leaf_node_set_strings(void* node, uint32_t cell_num, const char* username,
+                           const char* email) {
+  if (leaf_node_is_dict(node)) {
+    *leaf_node_dict_code(node, cell_num, COLUMN_USERNAME) =
+        leaf_node_dict_intern(node, cell_num, COLUMN_USERNAME, username);
+    *leaf_node_dict_code(node, cell_num, COLUMN_EMAIL) =
+        leaf_node_dict_intern(node, cell_num, COLUMN_EMAIL, email);
+    return;
+  }
+  memcpy(leaf_node_column(node, cell_num, COLUMN_USERNAME), username,
+         USERNAME_SIZE);
+  memcpy(leaf_node_column(node, cell_num, COLUMN_EMAIL), email, EMAIL_SIZE);
+}
+
+/* Stores key and a row laid out by serialize_row into the cell */
+void leaf_node_set_value(void* node, uint32_t cell_num, uint32_t key,
+                         void* value) {
+  *leaf_node_key(node, cell_num) = key;
+  leaf_node_zone_widen(node, value + USERNAME_OFFSET, value + EMAIL_OFFSET);
+  if (*leaf_node_layout(node) == LAYOUT_ROW) {
+    memcpy(leaf_node_value(node, cell_num), value, ROW_SIZE);
+    return;
+  }
+  leaf_node_set_strings(node, cell_num, value + USERNAME_OFFSET,
+                        value + EMAIL_OFFSET);
+}
+
+void leaf_node_zone_rebuild(void* node) {
+  leaf_node_zone_clear(node);
+  for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+    leaf_node_zone_widen(node, leaf_node_column(node, i, COLUMN_USERNAME),
+                         leaf_node_column(node, i, COLUMN_EMAIL));
+  }
+}
+
+/* Both leaves must have the same layout, as a leaf and its split do */
+void leaf_node_copy_cell(void* destination, uint32_t destination_cell,
+                         void* source, uint32_t source_cell) {
+  leaf_node_zone_widen(destination,
+                       leaf_node_column(source, source_cell, COLUMN_USERNAME),
+                       leaf_node_column(source, source_cell, COLUMN_EMAIL));
+  if (*leaf_node_layout(source) == LAYOUT_ROW) {
+    memcpy(leaf_node_cell(destination, destination_cell),
+           leaf_node_cell(source, source_cell), LEAF_NODE_CELL_SIZE);
+    return;
+  }
+  *leaf_node_key(destination, destination_cell) =
+      *leaf_node_key(source, source_cell);
+  if (leaf_node_is_dict(source) && destination == source) {
+    /* Same dictionary, so the codes carry over */
+    *leaf_node_dict_code(destination, destination_cell, COLUMN_USERNAME) =
+        *leaf_node_dict_code(source, source_cell, COLUMN_USERNAME);
+    *leaf_node_dict_code(destination, destination_cell, COLUMN_EMAIL) =
+        *leaf_node_dict_code(source, source_cell, COLUMN_EMAIL);
+    return;
+  }
+  leaf_node_set_strings(destination, destination_cell,
+                        leaf_node_column(source, source_cell, COLUMN_USERNAME),
+                        leaf_node_column(source, source_cell, COLUMN_EMAIL));
+}
+
+uint32_t* lsm_manifest_num_runs(void* node) {
+  return node + LSM_MANIFEST_NUM_RUNS_OFFSET;
+}
+
+uint32_t* lsm_manifest_num_free(void* node) {
+  return node + LSM_MANIFEST_NUM_FREE_OFFSET;
+}
+
+uint32_t* lsm_manifest_run(void* node, uint32_t run_num) {
+  return node + LSM_MANIFEST_RUNS_OFFSET + run_num * sizeof(uint32_t);
+}
+
+uint32_t* lsm_manifest_free_page(void* node, uint32_t free_num) {
+  return node + LSM_MANIFEST_FREE_OFFSET + free_num * sizeof(uint32_t);
+}
+
+uint32_t* lsm_run_num_blocks(void* node) {
+  return node + LSM_RUN_NUM_BLOCKS_OFFSET;
+}
+
+uint32_t* lsm_run_num_rows(void* node) {
+  return node + LSM_RUN_NUM_ROWS_OFFSET;
+}
+
+uint32_t* lsm_run_tier(void* node) { return node + LSM_RUN_TIER_OFFSET; }
+
+uint32_t* lsm_run_block_page(void* node, uint32_t block_num) {
+  return node + LSM_RUN_HEADER_SIZE + block_num * LSM_RUN_BLOCK_SIZE;
+}
+
+uint32_t* lsm_run_block_max_key(void* node, uint32_t block_num) {
+  return (void*)lsm_run_block_page(node, block_num) + LSM_RUN_BLOCK_PAGE_SIZE;
+}
+
+uint32_t* lsm_run_bloom(void* node) { return node + LSM_RUN_BLOOM_OFFSET; }
+
+/* Cached pages start on a cache line, so do the bloom filter blocks in them */
+void* page_alloc() { return aligned_alloc(CACHE_LINE_SIZE, PAGE_SIZE); }
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (page_num >= TABLE_MAX_PAGES) {
+    printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num,
+           TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+
+  pager->access_counts[page_num]++;
+  if (__atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE) == NULL) {
+    // Cache miss. Allocate memory and load from file.
+    pager->stats.cache_misses++;
+    TRACE(page_miss, page_num);
+    void* page = page_alloc();
+
+    ssize_t bytes_read = 0;
+    if (page_num < pager->file_num_pages) {
+      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+      bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      if (bytes_read > 0) {
+        pager->stats.pages_read++;
+      }
+      TRACE(page_read_done, page_num, bytes_read);
+      if (pager->checksum_mode == CHECKSUM_VERIFY_ON_READ &&
+          !page_checksum_valid(page)) {
+        printf("Page %d checksum mismatch. Corrupt file.\n", page_num);
         exit(EXIT_FAILURE);
       }
     }
+    if (bytes_read < PAGE_SIZE) {
+      /* New page past the end of the file, don't hand out stale heap data */
+      memset(page + bytes_read, 0, PAGE_SIZE - bytes_read);
+    }
 
-    pager->pages[page_num] = page;
+    void* expected = NULL;
+    if (!__atomic_compare_exchange_n(&pager->pages[page_num], &expected, page,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+      /* The prefetch thread loaded it while we were reading */
+      free(page);
+    }
 
     if (page_num >= pager->num_pages) {
       pager->num_pages = page_num + 1;
     }
+  } else {
+    pager->stats.cache_hits++;
   }
 
   return pager->pages[page_num];
 }
 
+/*
+Until we start recycling free pages, new pages will always
+go onto the end of the database file
+*/
+uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
+
 uint32_t get_node_max_key(Pager* pager, void* node) {
   if (get_node_type(node) == NODE_LEAF) {
     return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
@@ -272,6 +1549,23 @@ uint32_t get_node_max_key(Pager* pager, void* node) {
   return get_node_max_key(pager, right_child);
 }
 
+/* Number of levels below this node, so a leaf has height 0 */
+uint32_t get_node_height(Pager* pager, void* node) {
+  uint32_t height = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    node = get_page(pager, *internal_node_right_child(node));
+    height++;
+  }
+  return height;
+}
+
+void record_split(Table* table, uint32_t level) {
+  if (level >= STATS_MAX_LEVELS) {
+    level = STATS_MAX_LEVELS - 1;
+  }
+  table->stats.splits[level]++;
+}
+
 void print_constants() {
   printf("ROW_SIZE: %d\n", ROW_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
@@ -305,6 +1599,10 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
       num_keys = *internal_node_num_keys(node);
       indent(indentation_level);
       printf("- internal (size %d)\n", num_keys);
+      if (*internal_node_buffer_count(node) > 0) {
+        indent(indentation_level + 1);
+        printf("- buffer (size %d)\n", *internal_node_buffer_count(node));
+      }
       if (num_keys > 0) {
         for (uint32_t i = 0; i < num_keys; i++) {
           child = *internal_node_child(node, i);
@@ -317,6 +1615,22 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
         print_tree(pager, child, indentation_level + 1);
       }
       break;
+    case (NODE_LSM_MANIFEST):
+      num_keys = *lsm_manifest_num_runs(node);
+      indent(indentation_level);
+      printf("- lsm (runs %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        print_tree(pager, *lsm_manifest_run(node, i), indentation_level + 1);
+      }
+      break;
+    case (NODE_LSM_RUN):
+      indent(indentation_level);
+      printf("- run (tier %d, size %d)\n", *lsm_run_tier(node),
+             *lsm_run_num_rows(node));
+      for (uint32_t i = 0; i < *lsm_run_num_blocks(node); i++) {
+        print_tree(pager, *lsm_run_block_page(node, i), indentation_level + 1);
+      }
+      break;
   }
 }
 
@@ -332,11 +1646,25 @@ void deserialize_row(void* source, Row* destination) {
   memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
+/* Stores key and row into the cell */
+void leaf_node_set_row(void* node, uint32_t cell_num, uint32_t key,
+                       Row* row) {
+  *leaf_node_key(node, cell_num) = key;
+  leaf_node_zone_widen(node, row->username, row->email);
+  if (*leaf_node_layout(node) == LAYOUT_ROW) {
+    serialize_row(row, leaf_node_value(node, cell_num));
+    return;
+  }
+  leaf_node_set_strings(node, cell_num, row->username, row->email);
+}
+
 void initialize_leaf_node(void* node) {
   set_node_type(node, NODE_LEAF);
   set_node_root(node, false);
   *leaf_node_num_cells(node) = 0;
   *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+  *leaf_node_layout(node) = LAYOUT_ROW;
+  leaf_node_zone_clear(node);
 }
 
 void initialize_internal_node(void* node) {
@@ -344,6 +1672,7 @@ void initialize_internal_node(void* node) {
   set_node_root(node, false);
   *internal_node_num_keys(node) = 0;
   *internal_node_right_child(node) = INVALID_PAGE_NUM;
+  *internal_node_buffer_count(node) = 0;
 }
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
@@ -354,6 +1683,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
   cursor->table = table;
   cursor->page_num = page_num;
   cursor->end_of_table = false;
+  cursor->lsm = false;
 
   // Binary search
   uint32_t min_index = 0;
@@ -408,6 +1738,10 @@ Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
       return leaf_node_find(table, child_num, key);
     case NODE_INTERNAL:
       return internal_node_find(table, child_num, key);
+    default:
+      printf("Page %d has unexpected node type %d. Corrupt file.\n", child_num,
+             get_node_type(child));
+      exit(EXIT_FAILURE);
   }
 }
 
@@ -422,167 +1756,3582 @@ Cursor* table_find(Table* table, uint32_t key) {
   }
 }
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);
-
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+/* 64-bit mix of a key (splitmix64), for the bloom filters and hash index */
+uint64_t key_hash(uint32_t key) {
+  uint64_t hash = key + 0x9E3779B97F4A7C15ULL;
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  return hash ^ (hash >> 31);
+}
 
-  return cursor;
+/*
+Blocked bloom filters, split the way Parquet's are. The high half of a key's
+hash picks one 32-byte block, so a probe touches a single cache line; the
+low half, times eight odd salts, picks one bit in each of the block's eight
+words. With AVX2 all eight words are checked in a few instructions.
+*/
+const uint32_t BLOOM_SALTS[BLOOM_BLOCK_WORDS] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31};
+bool bloom_ready = false;
+bool bloom_avx2 = false;
+
+void bloom_init() {
+  if (bloom_ready) {
+    return;
+  }
+#if defined(__x86_64__)
+  bloom_avx2 = __builtin_cpu_supports("avx2");
+#endif
+  bloom_ready = true;
 }
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+uint32_t bloom_block_index(uint64_t hash, uint32_t num_blocks) {
+  return (hash >> 32) * num_blocks >> 32;
 }
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
+void bloom_block_add(uint32_t* block, uint32_t hash) {
+  for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+    block[i] |= 1u << ((hash * BLOOM_SALTS[i]) >> 27);
+  }
+}
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+bool bloom_block_check_software(const uint32_t* block, uint32_t hash) {
+  for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+    if (!(block[i] & (1u << ((hash * BLOOM_SALTS[i]) >> 27)))) {
+      return false;
     }
   }
+  return true;
 }
 
-Pager* pager_open(const char* filename) {
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) bool bloom_block_check_avx2(
+    const uint32_t* block, uint32_t hash) {
+  __m256i salts = _mm256_loadu_si256((const __m256i*)BLOOM_SALTS);
+  __m256i shifts =
+      _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(hash), salts), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), shifts);
+  __m256i bits = _mm256_loadu_si256((const __m256i*)block);
+  /* Carry flag: every bit of mask is set in bits */
+  return _mm256_testc_si256(bits, mask);
+}
+#endif
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+bool bloom_block_check(const uint32_t* block, uint32_t hash) {
+#if defined(__x86_64__)
+  if (bloom_avx2) {
+    return bloom_block_check_avx2(block, hash);
   }
+#endif
+  return bloom_block_check_software(block, hash);
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
+void bloom_add(uint32_t* blocks, uint32_t num_blocks, uint32_t key) {
+  uint64_t hash = key_hash(key);
+  bloom_block_add(blocks + bloom_block_index(hash, num_blocks) *
+                               BLOOM_BLOCK_WORDS,
+                  hash);
+}
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
+bool bloom_may_contain(uint32_t* blocks, uint32_t num_blocks, uint32_t key) {
+  uint64_t hash = key_hash(key);
+  return bloom_block_check(
+      blocks + bloom_block_index(hash, num_blocks) * BLOOM_BLOCK_WORDS, hash);
+}
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+MemtableNode* memtable_node_new(uint32_t key, uint32_t level) {
+  MemtableNode* node = malloc(sizeof(MemtableNode) +
+                              level * sizeof(MemtableNode*) + ROW_SIZE);
+  node->key = key;
+  node->value = (void*)(node->next + level);
+  for (uint32_t i = 0; i < level; i++) {
+    node->next[i] = NULL;
   }
+  return node;
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+void memtable_init(Memtable* memtable) {
+  memtable->head = memtable_node_new(0, LSM_SKIPLIST_MAX_LEVEL);
+  memtable->level = 1;
+  memtable->num_rows = 0;
+  memtable->rng = 0x2545F4914F6CDD1DULL;
+}
+
+void memtable_clear(Memtable* memtable) {
+  MemtableNode* node = memtable->head->next[0];
+  while (node != NULL) {
+    MemtableNode* next = node->next[0];
+    free(node);
+    node = next;
   }
+  for (uint32_t i = 0; i < LSM_SKIPLIST_MAX_LEVEL; i++) {
+    memtable->head->next[i] = NULL;
+  }
+  memtable->level = 1;
+  memtable->num_rows = 0;
+}
 
-  return pager;
+/* Each level up holds a quarter of the nodes of the one below */
+uint32_t memtable_random_level(Memtable* memtable) {
+  uint32_t level = 1;
+  while (level < LSM_SKIPLIST_MAX_LEVEL) {
+    memtable->rng ^= memtable->rng << 13;
+    memtable->rng ^= memtable->rng >> 7;
+    memtable->rng ^= memtable->rng << 17;
+    if ((memtable->rng & 3) != 0) {
+      break;
+    }
+    level++;
+  }
+  return level;
 }
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
+/*
+Fills previous[i] with the last node on level i whose key is below key,
+and returns the first node at or after key on level 0.
+*/
+MemtableNode* memtable_seek(Memtable* memtable, uint32_t key,
+                            MemtableNode** previous) {
+  MemtableNode* node = memtable->head;
+  for (int32_t i = memtable->level - 1; i >= 0; i--) {
+    while (node->next[i] != NULL && node->next[i]->key < key) {
+      node = node->next[i];
+    }
+    if (previous != NULL) {
+      previous[i] = node;
+    }
+  }
+  return node->next[0];
+}
 
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+MemtableNode* memtable_find(Memtable* memtable, uint32_t key) {
+  MemtableNode* node = memtable_seek(memtable, key, NULL);
+  return node != NULL && node->key == key ? node : NULL;
+}
 
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+void memtable_put(Memtable* memtable, uint32_t key, Row* row) {
+  MemtableNode* previous[LSM_SKIPLIST_MAX_LEVEL];
+  MemtableNode* node = memtable_seek(memtable, key, previous);
+  if (node == NULL || node->key != key) {
+    uint32_t level = memtable_random_level(memtable);
+    for (uint32_t i = memtable->level; i < level; i++) {
+      previous[i] = memtable->head;
+    }
+    if (level > memtable->level) {
+      memtable->level = level;
+    }
+    node = memtable_node_new(key, level);
+    for (uint32_t i = 0; i < level; i++) {
+      node->next[i] = previous[i]->next[i];
+      previous[i]->next[i] = node;
+    }
+    memtable->num_rows++;
   }
-
-  return table;
+  serialize_row(row, node->value);
 }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+/* Takes a page off the manifest's free list, or a new one */
+uint32_t lsm_allocate_page(Table* table) {
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t* num_free = lsm_manifest_num_free(manifest);
+  if (*num_free > 0) {
+    (*num_free)--;
+    return *lsm_manifest_free_page(manifest, *num_free);
+  }
+  return get_unused_page_num(table->pager);
+}
 
-  return input_buffer;
+void lsm_free_page(Table* table, uint32_t page_num) {
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t* num_free = lsm_manifest_num_free(manifest);
+  *lsm_manifest_free_page(manifest, *num_free) = page_num;
+  (*num_free)++;
 }
 
-void print_prompt() { printf("db > "); }
+void initialize_lsm_manifest(void* node) {
+  memset(node, 0, PAGE_SIZE);
+  set_node_type(node, NODE_LSM_MANIFEST);
+  set_node_root(node, true);
+}
 
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+uint32_t lsm_run_begin(Table* table, uint32_t tier) {
+  uint32_t page_num = lsm_allocate_page(table);
+  void* run = get_page(table->pager, page_num);
+  memset(run, 0, PAGE_SIZE);
+  set_node_type(run, NODE_LSM_RUN);
+  *lsm_run_tier(run) = tier;
+  return page_num;
+}
 
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+/* Rows must be appended in increasing key order */
+void lsm_run_append(Table* table, uint32_t run_page_num, uint32_t key,
+                    void* value) {
+  Pager* pager = table->pager;
+  void* run = get_page(pager, run_page_num);
+  uint32_t num_blocks = *lsm_run_num_blocks(run);
+  void* block = NULL;
+  if (num_blocks > 0) {
+    block = get_page(pager, *lsm_run_block_page(run, num_blocks - 1));
+  }
+  if (block == NULL || *leaf_node_num_cells(block) >= LEAF_NODE_MAX_CELLS) {
+    if (num_blocks == LSM_RUN_MAX_BLOCKS) {
+      /* Can't happen while inserts stop at LSM_MAX_ROWS */
+      printf("Error: LSM run is full.\n");
+      exit(EXIT_FAILURE);
+    }
+    uint32_t page_num = lsm_allocate_page(table);
+    void* new_block = get_page(pager, page_num);
+    initialize_leaf_node(new_block);
+    if (block != NULL) {
+      *leaf_node_next_leaf(block) = page_num;
+    }
+    *lsm_run_block_page(run, num_blocks) = page_num;
+    num_blocks++;
+    *lsm_run_num_blocks(run) = num_blocks;
+    block = new_block;
   }
 
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
+  uint32_t cell_num = *leaf_node_num_cells(block);
+  *leaf_node_key(block, cell_num) = key;
+  memcpy(leaf_node_value(block, cell_num), value, ROW_SIZE);
+  *leaf_node_num_cells(block) = cell_num + 1;
+  *lsm_run_block_max_key(run, num_blocks - 1) = key;
+  (*lsm_run_num_rows(run))++;
+  bloom_add(lsm_run_bloom(run), LSM_RUN_BLOOM_BLOCKS, key);
+  table->lsm->rows_written++;
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
+void lsm_run_free(Table* table, uint32_t run_page_num) {
+  void* run = get_page(table->pager, run_page_num);
+  uint32_t num_blocks = *lsm_run_num_blocks(run);
+  for (uint32_t i = 0; i < num_blocks; i++) {
+    lsm_free_page(table, *lsm_run_block_page(run, i));
+  }
+  lsm_free_page(table, run_page_num);
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
-  }
+/* Index of the first block whose largest key is at least key */
+uint32_t lsm_run_find_block(void* run, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *lsm_run_num_blocks(run);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (*lsm_run_block_max_key(run, index) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+/* Index of the first cell whose key is at least key */
+uint32_t leaf_node_find_cell(void* node, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *leaf_node_num_cells(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (*leaf_node_key(node, index) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+void lsm_source_seek(Table* table, LsmSource* source, uint32_t key) {
+  if (source->run_page_num == INVALID_PAGE_NUM) {
+    source->node = memtable_seek(&table->lsm->memtable, key, NULL);
+    source->done = source->node == NULL;
+    return;
+  }
+  void* run = get_page(table->pager, source->run_page_num);
+  source->block = lsm_run_find_block(run, key);
+  source->done = source->block >= *lsm_run_num_blocks(run);
+  if (!source->done) {
+    void* block = get_page(table->pager, *lsm_run_block_page(run, source->block));
+    source->cell = leaf_node_find_cell(block, key);
+  }
+}
+
+void* lsm_source_cell(Table* table, LsmSource* source) {
+  void* run = get_page(table->pager, source->run_page_num);
+  void* block = get_page(table->pager, *lsm_run_block_page(run, source->block));
+  return leaf_node_cell(block, source->cell);
+}
+
+uint32_t lsm_source_key(Table* table, LsmSource* source) {
+  if (source->run_page_num == INVALID_PAGE_NUM) {
+    return source->node->key;
+  }
+  return *(uint32_t*)lsm_source_cell(table, source);
+}
+
+void* lsm_source_value(Table* table, LsmSource* source) {
+  if (source->run_page_num == INVALID_PAGE_NUM) {
+    return source->node->value;
+  }
+  return lsm_source_cell(table, source) + LEAF_NODE_VALUE_OFFSET;
+}
+
+void lsm_source_next(Table* table, LsmSource* source) {
+  if (source->run_page_num == INVALID_PAGE_NUM) {
+    source->node = source->node->next[0];
+    source->done = source->node == NULL;
+    return;
+  }
+  void* run = get_page(table->pager, source->run_page_num);
+  void* block = get_page(table->pager, *lsm_run_block_page(run, source->block));
+  source->cell++;
+  if (source->cell >= *leaf_node_num_cells(block)) {
+    source->block++;
+    source->cell = 0;
+    source->done = source->block >= *lsm_run_num_blocks(run);
+  }
+}
+
+/*
+Index of the source at the smallest key, or -1 once all are done. Sources
+are ordered newest first, so on equal keys the newest version wins.
+*/
+int32_t lsm_sources_min(Table* table, LsmSource* sources,
+                        uint32_t num_sources) {
+  int32_t min = -1;
+  uint32_t min_key = 0;
+  for (uint32_t i = 0; i < num_sources; i++) {
+    if (sources[i].done) {
+      continue;
+    }
+    uint32_t key = lsm_source_key(table, &sources[i]);
+    if (min == -1 || key < min_key) {
+      min = i;
+      min_key = key;
+    }
+  }
+  return min;
+}
+
+/* Steps every source past key, dropping older versions of that row */
+void lsm_sources_advance(Table* table, LsmSource* sources,
+                         uint32_t num_sources, uint32_t key) {
+  for (uint32_t i = 0; i < num_sources; i++) {
+    if (!sources[i].done && lsm_source_key(table, &sources[i]) == key) {
+      lsm_source_next(table, &sources[i]);
+    }
+  }
+}
+
+void lsm_cursor_settle(Cursor* cursor) {
+  int32_t min = lsm_sources_min(cursor->table, cursor->sources,
+                                cursor->num_sources);
+  cursor->end_of_table = min == -1;
+  cursor->current = min;
+}
+
+/* A cursor at the first row with an id of at least key */
+Cursor* lsm_cursor_seek(Table* table, uint32_t key) {
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->lsm = true;
+  cursor->sources[0].run_page_num = INVALID_PAGE_NUM;
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+  for (uint32_t i = 0; i < num_runs; i++) {
+    cursor->sources[i + 1].run_page_num = *lsm_manifest_run(manifest, i);
+  }
+  cursor->num_sources = num_runs + 1;
+  for (uint32_t i = 0; i < cursor->num_sources; i++) {
+    lsm_source_seek(table, &cursor->sources[i], key);
+  }
+  lsm_cursor_settle(cursor);
+  return cursor;
+}
+
+/*
+The newest version of a row, or NULL. Runs whose bloom filter rules the
+key out are not read at all.
+*/
+void* lsm_get(Table* table, uint32_t key) {
+  MemtableNode* node = memtable_find(&table->lsm->memtable, key);
+  if (node != NULL) {
+    return node->value;
+  }
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+  for (uint32_t i = 0; i < num_runs; i++) {
+    void* run = get_page(table->pager, *lsm_manifest_run(manifest, i));
+    if (!bloom_may_contain(lsm_run_bloom(run), LSM_RUN_BLOOM_BLOCKS, key)) {
+      table->lsm->bloom_skips++;
+      continue;
+    }
+    uint32_t block_num = lsm_run_find_block(run, key);
+    if (block_num >= *lsm_run_num_blocks(run)) {
+      continue;
+    }
+    void* block = get_page(table->pager, *lsm_run_block_page(run, block_num));
+    uint32_t cell_num = leaf_node_find_cell(block, key);
+    if (cell_num < *leaf_node_num_cells(block) &&
+        *leaf_node_key(block, cell_num) == key) {
+      return leaf_node_value(block, cell_num);
+    }
+  }
+  return NULL;
+}
+
+/* Starts merging the runs of one tier, or every run */
+void lsm_start_compaction(Table* table, uint32_t tier, bool merge_all) {
+  LsmCompaction* compaction = &table->lsm->compaction;
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+  /* Runs stay newest first, so one tier's runs sit next to each other */
+  compaction->num_inputs = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    uint32_t run_page_num = *lsm_manifest_run(manifest, i);
+    if (merge_all ||
+        *lsm_run_tier(get_page(table->pager, run_page_num)) == tier) {
+      LsmSource* source = &compaction->sources[compaction->num_inputs];
+      source->run_page_num = run_page_num;
+      lsm_source_seek(table, source, 0);
+      compaction->inputs[compaction->num_inputs] = run_page_num;
+      compaction->num_inputs++;
+    }
+  }
+  compaction->output = lsm_run_begin(table, tier + 1);
+  compaction->active = true;
+}
+
+/* Starts merging the runs of the lowest tier that has filled up, if any */
+void lsm_maybe_start_compaction(Table* table) {
+  LsmCompaction* compaction = &table->lsm->compaction;
+  if (compaction->active) {
+    return;
+  }
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+  uint32_t tier_counts[LSM_MAX_RUNS] = {0};
+  uint32_t newer_rows = 0;
+  uint32_t oldest_rows = 0;
+  uint32_t oldest_tier = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    void* run = get_page(table->pager, *lsm_manifest_run(manifest, i));
+    uint32_t tier = *lsm_run_tier(run);
+    if (tier < LSM_MAX_RUNS) {
+      tier_counts[tier]++;
+    }
+    if (i + 1 < num_runs) {
+      newer_rows += *lsm_run_num_rows(run);
+    } else {
+      oldest_rows = *lsm_run_num_rows(run);
+      oldest_tier = tier;
+    }
+  }
+
+  /*
+  Tiers alone let stale copies of the rows in the oldest run pile up, which
+  a table capped at TABLE_MAX_PAGES can't afford. Once the newer runs hold
+  more than half as many rows as the oldest, merge everything into one run.
+  */
+  bool merge_all = num_runs > 1 && oldest_tier > 0 &&
+                   newer_rows > oldest_rows * LSM_MAX_SPACE_AMPLIFICATION;
+  uint32_t tier = 0;
+  while (tier < LSM_MAX_RUNS && tier_counts[tier] < LSM_TIER_FANOUT) {
+    tier++;
+  }
+  if (merge_all) {
+    tier = oldest_tier;
+  } else if (tier == LSM_MAX_RUNS) {
+    return;
+  }
+  lsm_start_compaction(table, tier, merge_all);
+}
+
+/* Puts the merged run in place of its inputs and frees their pages */
+void lsm_finish_compaction(Table* table) {
+  LsmCompaction* compaction = &table->lsm->compaction;
+  void* manifest = get_page(table->pager, table->root_page_num);
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    uint32_t run_page_num = *lsm_manifest_run(manifest, i);
+    if (run_page_num == compaction->inputs[0]) {
+      *lsm_manifest_run(manifest, kept++) = compaction->output;
+    }
+    bool input = false;
+    for (uint32_t j = 0; j < compaction->num_inputs; j++) {
+      input = input || run_page_num == compaction->inputs[j];
+    }
+    if (!input) {
+      *lsm_manifest_run(manifest, kept++) = run_page_num;
+    }
+  }
+  *lsm_manifest_num_runs(manifest) = kept;
+  /* Duplicates drop out of a merge, so the output's tier follows its size */
+  void* output = get_page(table->pager, compaction->output);
+  uint32_t tier = 0;
+  for (uint64_t rows = LSM_MEMTABLE_MAX_ROWS; *lsm_run_num_rows(output) > rows;
+       rows *= LSM_TIER_FANOUT) {
+    tier++;
+  }
+  *lsm_run_tier(output) = tier;
+  for (uint32_t i = 0; i < compaction->num_inputs; i++) {
+    lsm_run_free(table, compaction->inputs[i]);
+  }
+  compaction->active = false;
+  table->lsm->compactions++;
+  lsm_maybe_start_compaction(table);
+}
+
+/* Merges up to max_rows more rows of the compaction in progress */
+void lsm_compaction_step(Table* table, uint32_t max_rows) {
+  LsmCompaction* compaction = &table->lsm->compaction;
+  for (uint32_t i = 0; i < max_rows && compaction->active; i++) {
+    int32_t min = lsm_sources_min(table, compaction->sources,
+                                  compaction->num_inputs);
+    if (min == -1) {
+      lsm_finish_compaction(table);
+      continue;
+    }
+    LsmSource* source = &compaction->sources[min];
+    uint32_t key = lsm_source_key(table, source);
+    lsm_run_append(table, compaction->output, key,
+                   lsm_source_value(table, source));
+    lsm_sources_advance(table, compaction->sources, compaction->num_inputs,
+                        key);
+  }
+}
+
+/* Writes the memtable out as the newest run of tier 0 */
+void lsm_flush_memtable(Table* table) {
+  Memtable* memtable = &table->lsm->memtable;
+  if (memtable->num_rows == 0) {
+    return;
+  }
+  void* manifest = get_page(table->pager, table->root_page_num);
+  /*
+  Out of run slots: finish the merge in progress, or merge every run into
+  one, which LSM_MAX_ROWS guarantees fits
+  */
+  while (*lsm_manifest_num_runs(manifest) >= LSM_MAX_RUNS) {
+    if (!table->lsm->compaction.active) {
+      lsm_start_compaction(table, 0, true);
+    }
+    lsm_compaction_step(table, UINT32_MAX);
+  }
+  uint32_t num_runs = *lsm_manifest_num_runs(manifest);
+
+  uint32_t run_page_num = lsm_run_begin(table, 0);
+  for (MemtableNode* node = memtable->head->next[0]; node != NULL;
+       node = node->next[0]) {
+    lsm_run_append(table, run_page_num, node->key, node->value);
+  }
+  memmove(lsm_manifest_run(manifest, 1), lsm_manifest_run(manifest, 0),
+          num_runs * sizeof(uint32_t));
+  *lsm_manifest_run(manifest, 0) = run_page_num;
+  *lsm_manifest_num_runs(manifest) = num_runs + 1;
+  memtable_clear(memtable);
+  table->lsm->flushes++;
+  lsm_maybe_start_compaction(table);
+}
+
+/*
+Every write pays for a little compaction, so merging keeps up with
+flushes without any one statement doing it all.
+*/
+void lsm_put(Table* table, uint32_t key, Row* row) {
+  Lsm* lsm = table->lsm;
+  memtable_put(&lsm->memtable, key, row);
+  lsm->rows_put++;
+  if (lsm->memtable.num_rows >= LSM_MEMTABLE_MAX_ROWS) {
+    lsm_flush_memtable(table);
+  }
+  lsm_compaction_step(table, LSM_COMPACTION_ROWS_PER_WRITE);
+}
+
+Lsm* lsm_new() {
+  Lsm* lsm = calloc(1, sizeof(Lsm));
+  memtable_init(&lsm->memtable);
+  return lsm;
+}
+
+/* Leaves every row in runs, with no compaction half done */
+void lsm_close(Table* table) {
+  lsm_flush_memtable(table);
+  lsm_compaction_step(table, UINT32_MAX);
+  memtable_clear(&table->lsm->memtable);
+  free(table->lsm->memtable.head);
+  free(table->lsm);
+  table->lsm = NULL;
+}
+
+/* First internal node with buffered rows, top down, or INVALID_PAGE_NUM */
+uint32_t betree_find_buffered(Pager* pager, uint32_t page_num) {
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) != NODE_INTERNAL) {
+    return INVALID_PAGE_NUM;
+  }
+  if (*internal_node_buffer_count(node) > 0) {
+    return page_num;
+  }
+  for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+    uint32_t found = betree_find_buffered(pager, *internal_node_child(node, i));
+    if (found != INVALID_PAGE_NUM) {
+      return found;
+    }
+  }
+  return INVALID_PAGE_NUM;
+}
+
+uint64_t betree_buffered_rows(Pager* pager, uint32_t page_num) {
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) != NODE_INTERNAL) {
+    return 0;
+  }
+  uint64_t rows = *internal_node_buffer_count(node);
+  for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+    rows += betree_buffered_rows(pager, *internal_node_child(node, i));
+  }
+  return rows;
+}
+
+void* betree_get(Table* table, uint32_t key);
+void betree_flush_all(Table* table);
+void* hash_index_get(Table* table, uint32_t key);
+bool table_bloom_may_contain(Table* table, uint32_t key);
+
+Cursor* table_start(Table* table) {
+  if (table->lsm != NULL) {
+    return lsm_cursor_seek(table, 0);
+  }
+  if (table->betree) {
+    /* Cursors walk the leaves, so buffered rows have to reach them first */
+    betree_flush_all(table);
+  }
+  Cursor* cursor = table_find(table, 0);
+
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);
+
+  return cursor;
+}
+
+void* cursor_value(Cursor* cursor) {
+  if (cursor->lsm) {
+    return lsm_source_value(cursor->table, &cursor->sources[cursor->current]);
+  }
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(cursor->table->pager, page_num);
+  return leaf_node_row(page, cursor->cell_num, cursor->table->value_buffer);
+}
+
+/* One column of the row at the cursor, see leaf_node_column */
+void* cursor_column(Cursor* cursor, Column column) {
+  if (cursor->lsm) {
+    void* value = cursor_value(cursor);
+    switch (column) {
+      case COLUMN_ID:
+        return value + ID_OFFSET;
+      case COLUMN_USERNAME:
+        return value + USERNAME_OFFSET;
+      case COLUMN_EMAIL:
+        return value + EMAIL_OFFSET;
+    }
+  }
+  void* page = get_page(cursor->table->pager, cursor->page_num);
+  return leaf_node_column(page, cursor->cell_num, column);
+}
+
+void cursor_advance(Cursor* cursor) {
+  if (cursor->lsm) {
+    LsmSource* source = &cursor->sources[cursor->current];
+    lsm_sources_advance(cursor->table, cursor->sources, cursor->num_sources,
+                        lsm_source_key(cursor->table, source));
+    lsm_cursor_settle(cursor);
+    return;
+  }
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    } else {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+}
+
+/* A cursor at the first row with an id of at least key, for either engine */
+Cursor* table_seek(Table* table, uint32_t key) {
+  if (table->lsm != NULL) {
+    return lsm_cursor_seek(table, key);
+  }
+  if (table->betree) {
+    betree_flush_all(table);
+  }
+  Cursor* cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells == 0) {
+    cursor->end_of_table = true;
+  } else if (cursor->cell_num >= num_cells) {
+    /* Key past the end of this leaf, step onto the next one */
+    cursor->cell_num = num_cells - 1;
+    cursor_advance(cursor);
+  }
+  return cursor;
+}
+
+uint32_t lsm_count_rows(Table* table) {
+  uint32_t num_rows = 0;
+  Cursor* cursor = lsm_cursor_seek(table, 0);
+  while (!cursor->end_of_table) {
+    num_rows++;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  return num_rows;
+}
+
+/* table_get without the table's bloom filter */
+void* table_lookup(Table* table, uint32_t key) {
+  if (table->betree) {
+    return betree_get(table, key);
+  }
+  if (table->index != NULL) {
+    return hash_index_get(table, key);
+  }
+  Cursor* cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  void* value = NULL;
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == key) {
+    value = leaf_node_row(node, cursor->cell_num, table->value_buffer);
+  }
+  free(cursor);
+  return value;
+}
+
+/* The stored row with this id, or NULL */
+void* table_get(Table* table, uint32_t key) {
+  if (table->lsm != NULL) {
+    return lsm_get(table, key);
+  }
+  if (table->bloom == NULL) {
+    return table_lookup(table, key);
+  }
+  if (!table_bloom_may_contain(table, key)) {
+    table->stats.bloom_negatives++;
+    return NULL;
+  }
+  void* value = table_lookup(table, key);
+  if (value == NULL) {
+    table->stats.bloom_false_positives++;
+  }
+  return value;
+}
+
+RowCache* row_cache_new(uint32_t capacity) {
+  RowCache* cache = malloc(sizeof(RowCache));
+  cache->capacity = capacity;
+  for (uint32_t i = 0; i < ROW_CACHE_SHARDS; i++) {
+    RowCacheShard* shard = &cache->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    /* Spread the remainder so the shards add up to exactly capacity */
+    shard->capacity =
+        capacity / ROW_CACHE_SHARDS + (i < capacity % ROW_CACHE_SHARDS);
+    shard->num_used = 0;
+    shard->hand = 0;
+    shard->num_buckets = shard->capacity > 0 ? shard->capacity : 1;
+    shard->buckets = malloc(shard->num_buckets * sizeof(int32_t));
+    memset(shard->buckets, -1, shard->num_buckets * sizeof(int32_t));
+    shard->slots = calloc(shard->capacity, sizeof(RowCacheSlot));
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->evictions = 0;
+  }
+  return cache;
+}
+
+void row_cache_free(RowCache* cache) {
+  for (uint32_t i = 0; i < ROW_CACHE_SHARDS; i++) {
+    pthread_mutex_destroy(&cache->shards[i].lock);
+    free(cache->shards[i].buckets);
+    free(cache->shards[i].slots);
+  }
+  free(cache);
+}
+
+RowCacheShard* row_cache_shard(RowCache* cache, uint64_t hash) {
+  return &cache->shards[hash & (ROW_CACHE_SHARDS - 1)];
+}
+
+/* The link pointing at the key's slot, or at the -1 ending its bucket */
+int32_t* row_cache_link(RowCacheShard* shard, uint64_t hash, uint32_t key) {
+  int32_t* link = &shard->buckets[(hash >> 32) % shard->num_buckets];
+  while (*link != -1 && shard->slots[*link].key != key) {
+    link = &shard->slots[*link].next;
+  }
+  return link;
+}
+
+bool row_cache_get(RowCache* cache, uint32_t key, Row* row) {
+  uint64_t hash = key_hash(key);
+  RowCacheShard* shard = row_cache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  int32_t slot = *row_cache_link(shard, hash, key);
+  if (slot == -1) {
+    shard->misses++;
+  } else {
+    shard->hits++;
+    shard->slots[slot].referenced = true;
+    *row = shard->slots[slot].row;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return slot != -1;
+}
+
+/* Takes a free slot, or advances the hand to a victim and evicts it */
+int32_t row_cache_claim_slot(RowCacheShard* shard) {
+  if (shard->num_used < shard->capacity) {
+    return shard->num_used++;
+  }
+  while (shard->slots[shard->hand].used &&
+         shard->slots[shard->hand].referenced) {
+    shard->slots[shard->hand].referenced = false;
+    shard->hand = (shard->hand + 1) % shard->capacity;
+  }
+  int32_t slot = shard->hand;
+  shard->hand = (shard->hand + 1) % shard->capacity;
+  RowCacheSlot* victim = &shard->slots[slot];
+  if (victim->used) {
+    uint32_t key = victim->key;
+    *row_cache_link(shard, key_hash(key), key) = victim->next;
+    victim->used = false;
+    shard->evictions++;
+  }
+  return slot;
+}
+
+void row_cache_put(RowCache* cache, Row* row) {
+  uint64_t hash = key_hash(row->id);
+  RowCacheShard* shard = row_cache_shard(cache, hash);
+  if (shard->capacity == 0) {
+    return;
+  }
+  pthread_mutex_lock(&shard->lock);
+  int32_t* link = row_cache_link(shard, hash, row->id);
+  if (*link == -1) {
+    int32_t slot = row_cache_claim_slot(shard);
+    /* Eviction may have unlinked the slot *link was the tail of */
+    link = row_cache_link(shard, hash, row->id);
+    *link = slot;
+    shard->slots[slot].key = row->id;
+    shard->slots[slot].used = true;
+    shard->slots[slot].next = -1;
+  }
+  shard->slots[*link].referenced = false;
+  shard->slots[*link].row = *row;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void row_cache_invalidate(RowCache* cache, uint32_t key) {
+  uint64_t hash = key_hash(key);
+  RowCacheShard* shard = row_cache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  int32_t* link = row_cache_link(shard, hash, key);
+  if (*link != -1) {
+    RowCacheSlot* slot = &shard->slots[*link];
+    *link = slot->next;
+    slot->used = false;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* table_get, decoded, answered from the row cache when it has the id */
+bool table_get_row(Table* table, uint32_t key, Row* row) {
+  if (table->row_cache != NULL && row_cache_get(table->row_cache, key, row)) {
+    return true;
+  }
+  void* value = table_get(table, key);
+  if (value == NULL) {
+    return false;
+  }
+  deserialize_row(value, row);
+  if (table->row_cache != NULL) {
+    row_cache_put(table->row_cache, row);
+  }
+  return true;
+}
+
+/*
+Batched point lookups, for callers with many keys at once. Each lookup is a
+little state machine holding the page it needs next. When that page isn't
+in memory the lookup asks the kernel to read it ahead and parks, and the
+thread moves on to the other lookups, so up to ASYNC_LOOKUP_WINDOW disk
+reads are in flight instead of one. A parked lookup resumes on the next
+pass, by which time its read has usually landed in the kernel's cache.
+*/
+#define ASYNC_LOOKUP_WINDOW 128
+
+typedef struct {
+  uint32_t index;     // into the caller's keys
+  uint32_t page_num;  // next page to visit
+  bool parked;
+} AsyncLookup;
+
+Table* table_partition(Table* table, uint32_t key);
+
+bool page_is_resident(Pager* pager, uint32_t page_num) {
+  return __atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Searches the leaf the lookup has reached and fills in its answer */
+void async_lookup_finish(Table* table, AsyncLookup* lookup, void* leaf,
+                         uint32_t key, Row* rows, bool* found) {
+  Cursor* cursor = leaf_node_find(table, lookup->page_num, key);
+  uint32_t cell_num = cursor->cell_num;
+  free(cursor);
+  found[lookup->index] = cell_num < *leaf_node_num_cells(leaf) &&
+                         *leaf_node_key(leaf, cell_num) == key;
+  if (found[lookup->index]) {
+    deserialize_row(leaf_node_row(leaf, cell_num, table->value_buffer),
+                    &rows[lookup->index]);
+    if (table->row_cache != NULL) {
+      row_cache_put(table->row_cache, &rows[lookup->index]);
+    }
+  }
+}
+
+/*
+Descends from lookup->page_num until it reaches the leaf or a page that has
+to come from disk. Returns false if it parked, true once found[] is set.
+*/
+bool async_lookup_step(Table* table, AsyncLookup* lookup, const uint32_t* keys,
+                       Row* rows, bool* found) {
+  Pager* pager = table->pager;
+  uint32_t key = keys[lookup->index];
+  while (true) {
+    if (!lookup->parked && !page_is_resident(pager, lookup->page_num) &&
+        lookup->page_num < pager->file_num_pages) {
+      posix_fadvise(pager->file_descriptor,
+                    (off_t)lookup->page_num * PAGE_SIZE, PAGE_SIZE,
+                    POSIX_FADV_WILLNEED);
+      lookup->parked = true;
+      return false;
+    }
+    lookup->parked = false;
+    void* node = get_page(pager, lookup->page_num);
+    switch (get_node_type(node)) {
+      case NODE_INTERNAL:
+        lookup->page_num =
+            *internal_node_child(node, internal_node_find_child(node, key));
+        break;
+      case NODE_LEAF:
+        async_lookup_finish(table, lookup, node, key, rows, found);
+        return true;
+      default:
+        printf("Page %d has unexpected node type %d. Corrupt file.\n",
+               lookup->page_num, get_node_type(node));
+        exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+Looks up count keys at once, filling rows[i] and found[i] for keys[i]. It
+gives the same answers as table_get_row on each key, which is what it falls
+back to for engines other than the plain B-tree.
+*/
+void table_get_rows(Table* table, const uint32_t* keys, uint32_t count,
+                    Row* rows, bool* found) {
+  if (table->num_partitions > 0 || table->lsm != NULL || table->betree ||
+      table->index != NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      found[i] = table_get_row(table_partition(table, keys[i]), keys[i],
+                               &rows[i]);
+    }
+    return;
+  }
+
+  AsyncLookup window[ASYNC_LOOKUP_WINDOW];
+  uint32_t in_flight = 0;
+  uint32_t next = 0;
+  while (next < count || in_flight > 0) {
+    while (in_flight < ASYNC_LOOKUP_WINDOW && next < count) {
+      uint32_t key = keys[next];
+      if (table->row_cache != NULL &&
+          row_cache_get(table->row_cache, key, &rows[next])) {
+        found[next++] = true;
+        continue;
+      }
+      if (table->bloom != NULL && !table_bloom_may_contain(table, key)) {
+        table->stats.bloom_negatives++;
+        found[next++] = false;
+        continue;
+      }
+      window[in_flight++] = (AsyncLookup){next++, table->root_page_num, false};
+    }
+    for (uint32_t i = 0; i < in_flight;) {
+      if (async_lookup_step(table, &window[i], keys, rows, found)) {
+        uint32_t index = window[i].index;
+        if (table->bloom != NULL && !found[index]) {
+          table->stats.bloom_false_positives++;
+        }
+        window[i] = window[--in_flight];
+      } else {
+        i++;
+      }
+    }
+  }
+}
+
+bool predicate_equal(Predicate* a, Predicate* b) {
+  if (a->active != b->active) {
+    return false;
+  }
+  if (!a->active) {
+    return true;
+  }
+  if (a->column != b->column || a->comparison != b->comparison) {
+    return false;
+  }
+  return a->column == COLUMN_ID ? a->id == b->id
+                                : strcmp(a->text, b->text) == 0;
+}
+
+QueryCacheEntry* query_cache_slot(QueryCache* cache, Predicate* where) {
+  uint64_t hash = 0;
+  if (where->active) {
+    hash = where->column * 31 + where->comparison + 1;
+    if (where->column == COLUMN_ID) {
+      hash = hash * 31 + where->id;
+    } else {
+      for (char* c = where->text; *c != '\0'; c++) {
+        hash = hash * 31 + (unsigned char)*c;
+      }
+    }
+  }
+  return &cache->entries[key_hash(hash ^ hash >> 32) % QUERY_CACHE_SLOTS];
+}
+
+void query_cache_free(QueryCache* cache) {
+  for (uint32_t i = 0; i < QUERY_CACHE_SLOTS; i++) {
+    free(cache->entries[i].result);
+  }
+  free(cache);
+}
+
+/* Hands the result buffer over to the cache, which may free it */
+void query_cache_put(Table* table, Predicate* where, ResultBuffer* out) {
+  if (out->length > QUERY_CACHE_MAX_RESULT_SIZE) {
+    free(out->data);
+    return;
+  }
+  QueryCacheEntry* entry = query_cache_slot(table->query_cache, where);
+  free(entry->result);
+  entry->used = true;
+  entry->where = *where;
+  entry->version = table->version;
+  entry->result = out->data;
+  entry->length = out->length;
+}
+
+void* prefetch_hot_pages(void* argument) {
+  Pager* pager = argument;
+  for (uint32_t i = 0; i < pager->prefetch_count; i++) {
+    uint32_t page_num = pager->prefetch_list[i].page_num;
+    if (__atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE) != NULL) {
+      continue;
+    }
+    void* page = page_alloc();
+    ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE,
+                               (off_t)page_num * PAGE_SIZE);
+    void* expected = NULL;
+    /* A bad page is left for get_page to read again and report */
+    if (bytes_read != PAGE_SIZE ||
+        (pager->checksum_mode == CHECKSUM_VERIFY_ON_READ &&
+         !page_checksum_valid(page)) ||
+        !__atomic_compare_exchange_n(&pager->pages[page_num], &expected, page,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+      free(page);
+      continue;
+    }
+    __atomic_fetch_add(&pager->stats.pages_prefetched, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+int compare_hot_pages_by_page_num(const void* a, const void* b) {
+  uint32_t left = ((const HotPage*)a)->page_num;
+  uint32_t right = ((const HotPage*)b)->page_num;
+  return (left > right) - (left < right);
+}
+
+/*
+Reads the hot page list and starts loading those pages in file order on a
+background thread. The kernel is asked to read them all ahead first, so
+the disk sees the whole batch at once rather than one page at a time.
+*/
+void pager_start_prefetch(Pager* pager) {
+  FILE* in = fopen(pager->hot_pages_path, "r");
+  if (in == NULL) {
+    return;
+  }
+  uint32_t header[2];
+  if (fread(header, sizeof(uint32_t), 2, in) != 2 ||
+      header[0] != HOT_PAGES_MAGIC || header[1] > TABLE_MAX_PAGES) {
+    fclose(in);
+    return;
+  }
+  HotPage* list = malloc(sizeof(HotPage) * (header[1] + 1));
+  uint32_t count = 0;
+  HotPage entry;
+  for (uint32_t i = 0; i < header[1]; i++) {
+    if (fread(&entry, sizeof(HotPage), 1, in) != 1) {
+      break;
+    }
+    if (entry.page_num >= pager->num_pages) {
+      continue;
+    }
+    /* Halve old counts so frequencies decay across restarts */
+    pager->access_counts[entry.page_num] = entry.access_count / 2;
+    list[count++] = entry;
+  }
+  fclose(in);
+
+  if (count == 0) {
+    free(list);
+    return;
+  }
+  qsort(list, count, sizeof(HotPage), compare_hot_pages_by_page_num);
+  for (uint32_t start = 0; start < count;) {
+    uint32_t end = start + 1;
+    while (end < count && list[end].page_num == list[end - 1].page_num + 1) {
+      end++;
+    }
+    posix_fadvise(pager->file_descriptor, (off_t)list[start].page_num * PAGE_SIZE,
+                  (off_t)(end - start) * PAGE_SIZE, POSIX_FADV_WILLNEED);
+    start = end;
+  }
+
+  pager->prefetch_list = list;
+  pager->prefetch_count = count;
+  if (pthread_create(&pager->prefetch_thread, NULL, prefetch_hot_pages, pager) ==
+      0) {
+    pager->prefetch_running = true;
+  }
+}
+
+void pager_wait_for_prefetch(Pager* pager) {
+  if (pager->prefetch_running) {
+    pthread_join(pager->prefetch_thread, NULL);
+    pager->prefetch_running = false;
+  }
+  free(pager->prefetch_list);
+  pager->prefetch_list = NULL;
+  pager->prefetch_count = 0;
+}
+
+void pager_save_hot_pages(Pager* pager) {
+  FILE* out = fopen(pager->hot_pages_path, "w");
+  if (out == NULL) {
+    return;
+  }
+  uint32_t header[2] = {HOT_PAGES_MAGIC, 0};
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (pager->pages[i] != NULL) {
+      header[1]++;
+    }
+  }
+  fwrite(header, sizeof(uint32_t), 2, out);
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (pager->pages[i] == NULL) {
+      continue;
+    }
+    HotPage entry = {i, pager->access_counts[i]};
+    fwrite(&entry, sizeof(HotPage), 1, out);
+  }
+  fclose(out);
+}
+
+Pager* pager_open(const char* filename) {
+  int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+  Opening only reads and checks the header page, whatever the file size.
+  One zeroed allocation covers every empty page slot and counter; for a big
+  page table calloc hands back untouched zero pages instead of a loop.
+  */
+  Pager* pager = calloc(1, sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->checksum_mode = CHECKSUM_VERIFY_ON_READ;
+  crc32c_init();
+  bloom_init();
+
+  void* header = page_alloc();
+  ssize_t bytes_read = pread(fd, header, PAGE_SIZE, 0);
+  if (bytes_read == -1) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (bytes_read == 0) {
+    // New database file. The header reaches disk on close.
+    initialize_header(header);
+    pager->file_num_pages = 0;
+    pager->num_pages = 1;
+  } else {
+    if (bytes_read != PAGE_SIZE) {
+      printf("Db file is not a whole number of pages. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (*header_magic(header) != DB_MAGIC ||
+        *header_version(header) != DB_FORMAT_VERSION ||
+        *header_page_size(header) != PAGE_SIZE) {
+      printf("Db file is not a nottoSQL database.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (*header_checksum(header) != crc32c(header, HEADER_CHECKSUM_OFFSET) ||
+        !page_checksum_valid(header)) {
+      printf("Db file header checksum mismatch. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    uint32_t num_pages = *header_num_pages(header);
+    struct stat file_stat;
+    if (num_pages > TABLE_MAX_PAGES || fstat(fd, &file_stat) == -1 ||
+        file_stat.st_size < (off_t)num_pages * PAGE_SIZE) {
+      printf("Db file is shorter than its header says. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->file_num_pages = num_pages;
+    pager->num_pages = num_pages;
+    pager->stats.pages_read++;
+  }
+  pager->pages[HEADER_PAGE_NUM] = header;
+  pager->lsn = *header_lsn(header);
+
+  pager->hot_pages_path = malloc(strlen(filename) + sizeof("-hot"));
+  sprintf(pager->hot_pages_path, "%s-hot", filename);
+  pager_start_prefetch(pager);
+
+  return pager;
+}
+
+void hash_index_open(Table* table);
+void table_bloom_open(Table* table);
+void replication_resume(Table* table);
+void partitions_open(Table* table);
+
+Table* db_open(const char* filename) {
+  Pager* pager = pager_open(filename);
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  memset(&table->stats, 0, sizeof(TableStats));
+  memset(&table->latency, 0, sizeof(TableLatency));
+  memset(&table->scrub, 0, sizeof(Scrubber));
+  table->backup = NULL;
+  pthread_mutex_init(&table->scrub.lock, NULL);
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  if (*header_root_page_num(header) == INVALID_PAGE_NUM) {
+    // New database file. Initialize page 1 as leaf node.
+    table->root_page_num = get_unused_page_num(pager);
+    void* root_node = get_page(pager, table->root_page_num);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+  } else {
+    table->root_page_num = *header_root_page_num(header);
+  }
+  table->lsm = *header_engine(header) == ENGINE_LSM ? lsm_new() : NULL;
+  if (table->lsm != NULL) {
+    table->lsm->num_rows = lsm_count_rows(table);
+  }
+  table->betree = *header_engine(header) == ENGINE_BETREE;
+
+  table->index = NULL;
+  table->index_path = malloc(strlen(filename) + sizeof("-hash"));
+  sprintf(table->index_path, "%s-hash", filename);
+  hash_index_open(table);
+  table->bloom = NULL;
+  table->bloom_path = malloc(strlen(filename) + sizeof("-bloom"));
+  sprintf(table->bloom_path, "%s-bloom", filename);
+  table_bloom_open(table);
+  table->row_cache = NULL;
+  table->query_cache = NULL;
+  table->version = 0;
+  table->value_buffer = malloc(ROW_SIZE);
+  table->replication = NULL;
+  table->log_path = malloc(strlen(filename) + sizeof("-log"));
+  sprintf(table->log_path, "%s-log", filename);
+  table->filename = strdup(filename);
+  partitions_open(table);
+  replication_resume(table);
+
+  return table;
+}
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+void print_prompt() { printf("db > "); }
+
+void read_input(InputBuffer* input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Ignore trailing newline
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+/*
+Stamps a cached page with the current LSN if it changed since it was last
+sealed, and returns its LSN. Statements write to pages without telling the
+pager, but the checksum is only brought up to date here, so a page whose
+checksum no longer matches has been changed.
+*/
+uint64_t pager_seal_page(Pager* pager, void* page) {
+  if (!page_checksum_valid(page)) {
+    set_page_lsn(page, pager->lsn);
+    update_page_checksum(page);
+  }
+  return get_page_lsn(page);
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+  if (pager->pages[page_num] == NULL) {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t start = monotonic_ns();
+  TRACE(page_flush_start, page_num);
+  pager_seal_page(pager, pager->pages[page_num]);
+
+  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+
+  if (offset == -1) {
+    printf("Error seeking: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  ssize_t bytes_written =
+      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (page_num >= pager->file_num_pages) {
+    pager->file_num_pages = page_num + 1;
+  }
+  pager->stats.pages_written++;
+  TRACE(page_flush_done, page_num);
+  histogram_record(&pager->flush_latency, monotonic_ns() - start);
+}
+
+/*
+State for one pass of the integrity checker. It checks either the tree as
+the statements see it, with cached pages taking precedence over the file,
+or the file alone as the scrubber does. Either way every page that exists
+on disk is read with pread and its checksum verified, within the I/O budget.
+*/
+typedef struct {
+  Pager* pager;
+  bool from_disk;
+  uint32_t page_limit;
+  uint32_t pages_per_second;  // 0 for no limit
+  bool* stop;                 // NULL unless another thread can end the pass
+  uint64_t start_ns;
+  uint32_t pages_read;
+  uint32_t pages_checked;
+  uint32_t errors;
+  bool visited[TABLE_MAX_PAGES];
+  bool seen_leaf;
+  uint32_t leaf_depth;
+  uint32_t expected_next_leaf;
+  FILE* out;  // errors are printed here as they are found, if set
+  char first_error[SCRUB_PAGE_ERROR_SIZE];
+} Checker;
+
+void checker_init(Checker* checker, Pager* pager, bool from_disk,
+                  uint32_t pages_per_second, bool* stop) {
+  memset(checker, 0, sizeof(Checker));
+  checker->pager = pager;
+  checker->from_disk = from_disk;
+  checker->page_limit = from_disk ? pager->file_num_pages : pager->num_pages;
+  checker->pages_per_second = pages_per_second;
+  checker->stop = stop;
+  checker->start_ns = monotonic_ns();
+}
+
+bool checker_stopped(Checker* checker) {
+  return checker->stop != NULL &&
+         __atomic_load_n(checker->stop, __ATOMIC_ACQUIRE);
+}
+
+void checker_error(Checker* checker, uint32_t page_num, const char* format,
+                   ...) {
+  char message[SCRUB_ERROR_SIZE];
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(message, sizeof(message), format, arguments);
+  va_end(arguments);
+
+  if (checker->errors == 0) {
+    snprintf(checker->first_error, sizeof(checker->first_error),
+             "Page %u: %s", page_num, message);
+  }
+  checker->errors++;
+  if (checker->out != NULL) {
+    fprintf(checker->out, "Page %d: %s\n", page_num, message);
+  }
+}
+
+/* Sleeps until the monotonic clock reaches due, or stop is set */
+void sleep_until(uint64_t due, bool* stop) {
+  while (stop == NULL || !__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+    uint64_t now = monotonic_ns();
+    if (now >= due) {
+      break;
+    }
+    // Short naps, so a stop request is seen quickly
+    uint64_t nap = due - now < 10000000ULL ? due - now : 10000000ULL;
+    struct timespec duration = {0, (long)nap};
+    nanosleep(&duration, NULL);
+  }
+}
+
+/* Sleeps until the next read fits the pages per second budget */
+void checker_throttle(Checker* checker) {
+  if (checker->pages_per_second == 0) {
+    return;
+  }
+  sleep_until(checker->start_ns + (uint64_t)checker->pages_read *
+                                      1000000000ULL /
+                                      checker->pages_per_second,
+              checker->stop);
+}
+
+/*
+Returns the copy of the page to check, or NULL if there is none. The disk
+copy is read into buffer whenever it exists, to verify its checksum.
+*/
+void* checker_load(Checker* checker, uint32_t page_num, void* buffer) {
+  checker->pages_checked++;
+  bool on_disk = page_num < checker->pager->file_num_pages;
+  if (on_disk) {
+    checker_throttle(checker);
+    ssize_t bytes_read = pread(checker->pager->file_descriptor, buffer,
+                               PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+    checker->pages_read++;
+    if (bytes_read != PAGE_SIZE) {
+      checker_error(checker, page_num, "short read");
+      on_disk = false;
+    } else if (!page_checksum_valid(buffer)) {
+      checker_error(checker, page_num, "checksum mismatch");
+    }
+  }
+  if (!checker->from_disk) {
+    void* cached =
+        __atomic_load_n(&checker->pager->pages[page_num], __ATOMIC_ACQUIRE);
+    if (cached != NULL) {
+      return cached;
+    }
+  }
+  if (!on_disk) {
+    checker_error(checker, page_num, "page is missing");
+    return NULL;
+  }
+  return buffer;
+}
+
+/*
+Checks the subtree at page_num. Every key in it must be greater than lower
+(when has_lower) and at most upper (when has_upper), which is how internal
+node keys bound their children.
+*/
+void check_node(Checker* checker, uint32_t page_num, uint32_t parent_page_num,
+                uint32_t depth, bool has_lower, uint32_t lower, bool has_upper,
+                uint32_t upper) {
+  if (checker_stopped(checker)) {
+    return;
+  }
+  if (page_num == HEADER_PAGE_NUM || page_num >= checker->page_limit) {
+    checker_error(checker, page_num, "child of page %d is out of range",
+                  parent_page_num);
+    return;
+  }
+  if (checker->visited[page_num]) {
+    checker_error(checker, page_num, "reached twice");
+    return;
+  }
+  checker->visited[page_num] = true;
+
+  void* buffer = malloc(PAGE_SIZE);
+  void* node = checker_load(checker, page_num, buffer);
+  if (node == NULL) {
+    free(buffer);
+    return;
+  }
+
+  bool is_root = parent_page_num == INVALID_PAGE_NUM;
+  if (is_node_root(node) != is_root) {
+    checker_error(checker, page_num, "root flag is %d", is_node_root(node));
+  }
+  if (!is_root && *node_parent(node) != parent_page_num) {
+    checker_error(checker, page_num, "parent pointer is %d, expected %d",
+                  *node_parent(node), parent_page_num);
+  }
+
+  if (get_node_type(node) == NODE_LEAF) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells > LEAF_NODE_MAX_CELLS) {
+      checker_error(checker, page_num, "%d cells", num_cells);
+      num_cells = LEAF_NODE_MAX_CELLS;
+    }
+    for (uint32_t i = 0; i < num_cells; i++) {
+      uint32_t key = *leaf_node_key(node, i);
+      if ((i > 0 && key <= *leaf_node_key(node, i - 1)) ||
+          (has_lower && key <= lower) || (has_upper && key > upper)) {
+        checker_error(checker, page_num, "key %d is out of order", key);
+      }
+    }
+
+    if (!checker->seen_leaf) {
+      checker->seen_leaf = true;
+      checker->leaf_depth = depth;
+    } else {
+      if (depth != checker->leaf_depth) {
+        checker_error(checker, page_num, "leaf at depth %d, expected %d",
+                      depth, checker->leaf_depth);
+      }
+      if (checker->expected_next_leaf != page_num) {
+        checker_error(checker, page_num, "previous leaf links to page %d",
+                      checker->expected_next_leaf);
+      }
+    }
+    checker->expected_next_leaf = *leaf_node_next_leaf(node);
+    free(buffer);
+    return;
+  }
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (num_keys > INTERNAL_NODE_MAX_KEYS) {
+    checker_error(checker, page_num, "%d keys", num_keys);
+    num_keys = INTERNAL_NODE_MAX_KEYS;
+  }
+  uint32_t right_child = *internal_node_right_child(node);
+  if (right_child == INVALID_PAGE_NUM) {
+    checker_error(checker, page_num, "no right child");
+    free(buffer);
+    return;
+  }
+
+  uint32_t buffer_count = *internal_node_buffer_count(node);
+  if (buffer_count > INTERNAL_NODE_BUFFER_MAX_MESSAGES) {
+    checker_error(checker, page_num, "%d buffered rows", buffer_count);
+    buffer_count = INTERNAL_NODE_BUFFER_MAX_MESSAGES;
+  }
+  for (uint32_t i = 0; i < buffer_count; i++) {
+    uint32_t key = *internal_node_message_key(node, i);
+    if ((i > 0 && key <= *internal_node_message_key(node, i - 1)) ||
+        (has_lower && key <= lower) || (has_upper && key > upper)) {
+      checker_error(checker, page_num, "buffered row %d is out of order", key);
+    }
+  }
+
+  /* Copy the cells out, the buffer is reused further down the walk */
+  uint32_t keys[INTERNAL_NODE_MAX_KEYS];
+  uint32_t children[INTERNAL_NODE_MAX_KEYS];
+  for (uint32_t i = 0; i < num_keys; i++) {
+    keys[i] = *internal_node_key(node, i);
+    children[i] = *(uint32_t*)internal_node_cell(node, i);
+    if ((i > 0 && keys[i] <= keys[i - 1]) || (has_lower && keys[i] <= lower) ||
+        (has_upper && keys[i] > upper)) {
+      checker_error(checker, page_num, "key %d is out of order", keys[i]);
+    }
+  }
+  free(buffer);
+
+  for (uint32_t i = 0; i < num_keys; i++) {
+    bool child_has_lower = i > 0 || has_lower;
+    uint32_t child_lower = i > 0 ? keys[i - 1] : lower;
+    check_node(checker, children[i], page_num, depth + 1, child_has_lower,
+               child_lower, true, keys[i]);
+  }
+  check_node(checker, right_child, page_num, depth + 1,
+             num_keys > 0 || has_lower, num_keys > 0 ? keys[num_keys - 1] : lower,
+             has_upper, upper);
+}
+
+/*
+Runs one pass over the database. When checking the file alone, the root
+comes from the header on disk, otherwise from root_page_num.
+*/
+void check_database(Checker* checker, uint32_t root_page_num) {
+  void* buffer = malloc(PAGE_SIZE);
+  bool lsm = false;
+  if (checker->page_limit > HEADER_PAGE_NUM) {
+    checker->visited[HEADER_PAGE_NUM] = true;
+    void* header = checker_load(checker, HEADER_PAGE_NUM, buffer);
+    if (header != NULL && *header_magic(header) != DB_MAGIC) {
+      checker_error(checker, HEADER_PAGE_NUM, "bad magic number");
+    }
+    if (checker->from_disk) {
+      root_page_num = header != NULL ? *header_root_page_num(header)
+                                     : INVALID_PAGE_NUM;
+    }
+    lsm = header != NULL && *header_engine(header) == ENGINE_LSM;
+  }
+  free(buffer);
+  if (root_page_num == INVALID_PAGE_NUM) {
+    // Nothing on disk yet
+    return;
+  }
+  if (lsm) {
+    /* Only the B-tree's structure is checked; LSM pages get checksums */
+    buffer = malloc(PAGE_SIZE);
+    for (uint32_t i = HEADER_PAGE_NUM + 1;
+         i < checker->page_limit && !checker_stopped(checker); i++) {
+      checker->visited[i] = true;
+      checker_load(checker, i, buffer);
+    }
+    free(buffer);
+    return;
+  }
+
+  check_node(checker, root_page_num, INVALID_PAGE_NUM, 0, false, 0, false, 0);
+  if (checker_stopped(checker)) {
+    return;
+  }
+  if (checker->seen_leaf && checker->expected_next_leaf != 0) {
+    checker_error(checker, checker->expected_next_leaf,
+                  "linked from the last leaf");
+  }
+  for (uint32_t i = 0; i < checker->page_limit; i++) {
+    if (!checker->visited[i]) {
+      checker_error(checker, i, "not in the tree");
+    }
+  }
+}
+
+void* scrub_database(void* argument) {
+  Table* table = argument;
+  Scrubber* scrub = &table->scrub;
+  while (!__atomic_load_n(&scrub->stop, __ATOMIC_ACQUIRE)) {
+    Checker* checker = malloc(sizeof(Checker));
+    checker_init(checker, table->pager, true,
+                 __atomic_load_n(&scrub->pages_per_second, __ATOMIC_RELAXED),
+                 &scrub->stop);
+    check_database(checker, INVALID_PAGE_NUM);
+    if (checker_stopped(checker)) {
+      free(checker);
+      break;
+    }
+
+    pthread_mutex_lock(&scrub->lock);
+    scrub->passes++;
+    scrub->pages_checked += checker->pages_read;
+    scrub->errors = checker->errors;
+    if (checker->errors > 0) {
+      strcpy(scrub->last_error, checker->first_error);
+    }
+    pthread_mutex_unlock(&scrub->lock);
+
+    if (checker->pages_read == 0) {
+      // Empty file, wait a second before looking again
+      sleep_until(monotonic_ns() + 1000000000ULL, &scrub->stop);
+    }
+    free(checker);
+  }
+  return NULL;
+}
+
+void scrub_start(Table* table, uint32_t pages_per_second) {
+  Scrubber* scrub = &table->scrub;
+  __atomic_store_n(&scrub->pages_per_second, pages_per_second,
+                   __ATOMIC_RELAXED);
+  if (scrub->running) {
+    return;
+  }
+  scrub->stop = false;
+  if (pthread_create(&scrub->thread, NULL, scrub_database, table) != 0) {
+    printf("Error starting scrub thread.\n");
+    exit(EXIT_FAILURE);
+  }
+  scrub->running = true;
+}
+
+void scrub_stop(Table* table) {
+  Scrubber* scrub = &table->scrub;
+  if (!scrub->running) {
+    return;
+  }
+  __atomic_store_n(&scrub->stop, true, __ATOMIC_RELEASE);
+  pthread_join(scrub->thread, NULL);
+  scrub->running = false;
+}
+
+/*
+Returns the LSN of a page without reading all of it, unless it is cached.
+The trailer alone is read from disk.
+*/
+uint64_t backup_page_lsn(Pager* pager, uint32_t page_num) {
+  void* page = pager->pages[page_num];
+  if (page != NULL) {
+    return pager_seal_page(pager, page);
+  }
+  uint64_t lsn;
+  ssize_t bytes_read =
+      pread(pager->file_descriptor, &lsn, PAGE_LSN_SIZE,
+            (off_t)page_num * PAGE_SIZE + PAGE_LSN_OFFSET);
+  if (bytes_read != PAGE_LSN_SIZE) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  return lsn;
+}
+
+void backup_write(Backup* backup, void* page, uint32_t page_num) {
+  ssize_t bytes_written = pwrite(backup->file_descriptor, page, PAGE_SIZE,
+                                 (off_t)page_num * PAGE_SIZE);
+  if (bytes_written != PAGE_SIZE) {
+    printf("Error writing backup: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Brings one page of the target up to date, if it is not already */
+void backup_page(Pager* pager, Backup* backup, uint32_t page_num) {
+  uint64_t lsn = backup_page_lsn(pager, page_num);
+  bool current = backup->visited[page_num]
+                     ? lsn == backup->copied_lsn[page_num]
+                     : lsn <= backup->since_lsn;
+  if (current) {
+    if (!backup->visited[page_num]) {
+      backup->pages_unchanged++;
+    }
+  } else {
+    /* Copied from the cache when possible, so the disk is not read twice */
+    void* page = pager->pages[page_num];
+    void* buffer = NULL;
+    if (page == NULL) {
+      buffer = malloc(PAGE_SIZE);
+      if (pread(pager->file_descriptor, buffer, PAGE_SIZE,
+                (off_t)page_num * PAGE_SIZE) != PAGE_SIZE) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      page = buffer;
+    }
+    backup_write(backup, page, page_num);
+    free(buffer);
+    if (backup->visited[page_num]) {
+      backup->pages_recopied++;
+    } else {
+      backup->pages_copied++;
+    }
+  }
+  backup->visited[page_num] = true;
+  backup->copied_lsn[page_num] = lsn;
+}
+
+/*
+Starts a backup to path. If the file there is an earlier backup of this
+database, it is updated incrementally; anything else is overwritten.
+Returns false, with no backup in progress, if the file can't be opened.
+*/
+bool backup_begin(Table* table, const char* path) {
+  Pager* pager = table->pager;
+  int fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    return false;
+  }
+
+  Backup* backup = calloc(1, sizeof(Backup));
+  backup->path = strdup(path);
+  backup->file_descriptor = fd;
+  backup->next_page = HEADER_PAGE_NUM + 1;
+
+  void* target_header = malloc(PAGE_SIZE);
+  void* header = pager->pages[HEADER_PAGE_NUM];
+  if (pread(fd, target_header, PAGE_SIZE, 0) == PAGE_SIZE &&
+      *header_magic(target_header) == DB_MAGIC &&
+      *header_version(target_header) == DB_FORMAT_VERSION &&
+      page_checksum_valid(target_header) &&
+      *header_db_id(target_header) == *header_db_id(header) &&
+      *header_lsn(target_header) < pager->lsn) {
+    backup->since_lsn = *header_lsn(target_header);
+  }
+  free(target_header);
+  table->backup = backup;
+  return true;
+}
+
+/* Copies up to max_pages more pages. Returns true once every page is done. */
+bool backup_step(Table* table, uint32_t max_pages) {
+  Pager* pager = table->pager;
+  Backup* backup = table->backup;
+  for (uint32_t i = 0; i < max_pages && backup->next_page < pager->num_pages;
+       i++) {
+    backup_page(pager, backup, backup->next_page);
+    backup->next_page++;
+  }
+  /* Whatever changes before the next step is newer than what was copied */
+  pager->lsn++;
+  return backup->next_page >= pager->num_pages;
+}
+
+/*
+Copies the pages changed since they were copied, then writes the header
+last. The target is a consistent image of the database as of this call.
+Returns the LSN the target is current to.
+*/
+uint64_t backup_finish(Table* table) {
+  Pager* pager = table->pager;
+  Backup* backup = table->backup;
+  if (table->lsm != NULL) {
+    /* Rows still in memory go into a run, so the copy has them */
+    lsm_flush_memtable(table);
+  }
+  backup_step(table, TABLE_MAX_PAGES);
+  for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++) {
+    backup_page(pager, backup, i);
+  }
+
+  uint64_t backup_lsn = pager->lsn;
+  pager->lsn++;
+
+  void* header = malloc(PAGE_SIZE);
+  memcpy(header, pager->pages[HEADER_PAGE_NUM], PAGE_SIZE);
+  *header_num_pages(header) = pager->num_pages;
+  *header_root_page_num(header) = table->root_page_num;
+  *header_lsn(header) = backup_lsn;
+  update_header_checksum(header);
+  set_page_lsn(header, backup_lsn);
+  update_page_checksum(header);
+  backup_write(backup, header, HEADER_PAGE_NUM);
+  free(header);
+
+  if (ftruncate(backup->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) ==
+          -1 ||
+      fsync(backup->file_descriptor) == -1 ||
+      close(backup->file_descriptor) == -1) {
+    printf("Error writing backup: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  return backup_lsn;
+}
+
+void backup_free(Table* table) {
+  free(table->backup->path);
+  free(table->backup);
+  table->backup = NULL;
+}
+
+/* Called between statements, advances a backup in progress */
+void backup_continue(Table* table) {
+  if (table->backup != NULL && backup_step(table, BACKUP_PAGES_PER_STEP)) {
+    backup_finish(table);
+    backup_free(table);
+  }
+}
+
+/* Records written in full; the primary may be halfway through the next */
+uint64_t log_num_records(int file_descriptor) {
+  struct stat log_stat;
+  if (fstat(file_descriptor, &log_stat) == -1) {
+    printf("Error reading log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  return log_stat.st_size / sizeof(LogRecord);
+}
+
+void replication_free(Table* table) {
+  close(table->replication->file_descriptor);
+  free(table->replication->primary_path);
+  free(table->replication);
+  table->replication = NULL;
+}
+
+void replication_append(Table* table, StatementType type, Row* row) {
+  Replication* replication = table->replication;
+  LogRecord record;
+  memset(&record, 0, sizeof(LogRecord));
+  record.lsn = replication->lsn + 1;
+  record.written_ns = realtime_ns();
+  record.type = type;
+  record.row = *row;
+  if (write(replication->file_descriptor, &record, sizeof(LogRecord)) !=
+      sizeof(LogRecord)) {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  replication->lsn = record.lsn;
+}
+
+/* Counts the partitions' rows too */
+bool table_is_empty(Table* table) {
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    if (!table_is_empty(table->partitions[i])) {
+      return false;
+    }
+  }
+  Cursor* cursor = table_start(table);
+  bool empty = cursor->end_of_table;
+  free(cursor);
+  return empty;
+}
+
+/* Logs an insert for every row of source, a table or one of its partitions */
+void replication_seed(Table* table, Table* source) {
+  for (uint32_t i = 0; i < source->num_partitions; i++) {
+    replication_seed(table, source->partitions[i]);
+  }
+  Cursor* cursor = table_start(source);
+  Row row;
+  while (!cursor->end_of_table) {
+    deserialize_row(cursor_value(cursor), &row);
+    replication_append(table, STATEMENT_INSERT, &row);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+}
+
+/*
+Opens <db>-log for appending, dropping a record left half written. An empty
+log first gets every row in the table as an insert, so a follower starting
+from an empty table ends up with the same rows.
+*/
+void replication_start_primary(Table* table) {
+  int fd = open(table->log_path, O_RDWR | O_CREAT | O_APPEND,
+                S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t num_records = log_num_records(fd);
+  if (ftruncate(fd, num_records * sizeof(LogRecord)) == -1) {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  table->replication = calloc(1, sizeof(Replication));
+  table->replication->role = REPLICATION_PRIMARY;
+  table->replication->file_descriptor = fd;
+  table->replication->lsn = num_records;
+  if (num_records == 0) {
+    replication_seed(table, table);
+  }
+}
+
+/* A database whose log was left in place is still a primary */
+void replication_resume(Table* table) {
+  if (access(table->log_path, F_OK) == 0) {
+    replication_start_primary(table);
+  }
+}
+
+void replication_stop_primary(Table* table) {
+  replication_free(table);
+  unlink(table->log_path);
+}
+
+char* replication_log_path(const char* primary_path) {
+  char* log_path = malloc(strlen(primary_path) + sizeof("-log"));
+  sprintf(log_path, "%s-log", primary_path);
+  return log_path;
+}
+
+/* Returns false if the primary has no log */
+bool replication_follow(Table* table, const char* primary_path) {
+  char* log_path = replication_log_path(primary_path);
+  int fd = open(log_path, O_RDONLY);
+  free(log_path);
+  if (fd == -1) {
+    return false;
+  }
+  table->replication = calloc(1, sizeof(Replication));
+  table->replication->role = REPLICATION_FOLLOWER;
+  table->replication->file_descriptor = fd;
+  table->replication->primary_path = strdup(primary_path);
+  return true;
+}
+
+/*
+True while the primary's log path still names the file the follower has
+open. `.primary off` unlinks the log and `.primary` starts a new one, and
+the old file would otherwise be read forever without ever shrinking.
+*/
+bool replication_log_is_current(Replication* replication) {
+  char* log_path = replication_log_path(replication->primary_path);
+  struct stat path_stat;
+  struct stat open_stat;
+  bool current = stat(log_path, &path_stat) == 0 &&
+                 fstat(replication->file_descriptor, &open_stat) == 0 &&
+                 path_stat.st_dev == open_stat.st_dev &&
+                 path_stat.st_ino == open_stat.st_ino;
+  free(log_path);
+  return current;
+}
+
+bool replication_is_follower(Table* table) {
+  return table->replication != NULL &&
+         table->replication->role == REPLICATION_FOLLOWER;
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table);
+ExecuteResult execute_update(Statement* statement, Table* table);
+
+/*
+Called between statements on a follower, applies whatever the primary has
+logged since the last call, and stops following if the primary has
+dropped that log. Like backups it waits for a statement boundary
+rather than use a thread, because the pager has no latching.
+*/
+void replication_poll(Table* table) {
+  if (!replication_is_follower(table)) {
+    return;
+  }
+  Replication* replication = table->replication;
+  uint64_t num_records = log_num_records(replication->file_descriptor);
+  if (num_records < replication->lsn) {
+    printf("Primary log was reset, stopped following.\n");
+    replication_free(table);
+    return;
+  }
+  Statement statement;
+  LogRecord record;
+  while (replication->lsn < num_records) {
+    if (pread(replication->file_descriptor, &record, sizeof(LogRecord),
+              replication->lsn * sizeof(LogRecord)) != sizeof(LogRecord)) {
+      printf("Error reading log: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (record.lsn != replication->lsn + 1) {
+      printf("Primary log is out of order, stopped following.\n");
+      replication_free(table);
+      return;
+    }
+    statement.type = record.type;
+    statement.row_to_insert = record.row;
+    if (record.type == STATEMENT_INSERT) {
+      execute_insert(&statement, table);
+    } else {
+      execute_update(&statement, table);
+    }
+    replication->lsn = record.lsn;
+    uint64_t now = realtime_ns();
+    replication->lag_ns = now > record.written_ns ? now - record.written_ns : 0;
+  }
+  /* Records already in the old log were applied above, they did happen */
+  if (!replication_log_is_current(replication)) {
+    printf("Primary log was replaced or removed, stopped following.\n");
+    replication_free(table);
+  }
+}
+
+/*
+Writes the header and every cached page, then cuts the file down to the
+pages in use.
+*/
+void pager_checkpoint(Pager* pager, uint32_t root_page_num) {
+  void* header = pager->pages[HEADER_PAGE_NUM];
+  *header_num_pages(header) = pager->num_pages;
+  *header_root_page_num(header) = root_page_num;
+  *header_lsn(header) = pager->lsn;
+  update_header_checksum(header);
+
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (pager->pages[i] == NULL) {
+      continue;
+    }
+    pager_flush(pager, i);
+  }
+
+  struct stat file_stat;
+  off_t length = (off_t)pager->num_pages * PAGE_SIZE;
+  if (fstat(pager->file_descriptor, &file_stat) == -1 ||
+      (file_stat.st_size > length &&
+       ftruncate(pager->file_descriptor, length) == -1)) {
+    printf("Error truncating db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->file_num_pages = pager->num_pages;
+}
+
+void table_checkpoint(Table* table) {
+  pager_checkpoint(table->pager, table->root_page_num);
+}
+
+void pager_close(Pager* pager) {
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    void* page = pager->pages[i];
+    if (page) {
+      free(page);
+      pager->pages[i] = NULL;
+    }
+  }
+  free(pager->hot_pages_path);
+  free(pager);
+}
+
+/*
+Hash index. Maps ids to the leaf holding them with extendible hashing, so a
+point select reads one bucket page and then the leaf instead of descending
+the tree. It lives in <db>-hash, a second file in the usual page format, and
+is kept up to date wherever rows land on a new leaf: inserts, splits, a new
+root, defrag moves and vacuum. Only the B-tree engine keeps rows in leaves
+that stay put otherwise, so only it can have one.
+*/
+uint32_t hash_index_bucket(HashIndex* index, uint32_t key) {
+  void* directory = get_page(index->pager, index->directory_page_num);
+  uint32_t mask = (1u << *hash_directory_depth(directory)) - 1;
+  return *hash_directory_slot(directory, key_hash(key) & mask);
+}
+
+/* Splits a full bucket on the next hash bit, doubling the directory first
+ * if the bucket already uses every bit it has */
+void hash_index_split(HashIndex* index, uint32_t bucket_page_num) {
+  void* directory = get_page(index->pager, index->directory_page_num);
+  void* bucket = get_page(index->pager, bucket_page_num);
+  uint32_t depth = *hash_bucket_depth(bucket);
+  uint32_t global_depth = *hash_directory_depth(directory);
+  if (depth == global_depth) {
+    if (global_depth == HASH_INDEX_MAX_DEPTH) {
+      printf("Error: Hash index full.\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(hash_directory_slot(directory, 1u << global_depth),
+           hash_directory_slot(directory, 0),
+           (1u << global_depth) * sizeof(uint32_t));
+    *hash_directory_depth(directory) = ++global_depth;
+  }
+
+  uint32_t new_page_num = get_unused_page_num(index->pager);
+  void* new_bucket = get_page(index->pager, new_page_num);
+  *hash_bucket_depth(bucket) = depth + 1;
+  *hash_bucket_depth(new_bucket) = depth + 1;
+  *hash_bucket_num_entries(new_bucket) = 0;
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < *hash_bucket_num_entries(bucket); i++) {
+    uint32_t key = *hash_bucket_key(bucket, i);
+    void* destination = (key_hash(key) >> depth) & 1 ? new_bucket : bucket;
+    uint32_t entry = destination == bucket
+                         ? kept++
+                         : (*hash_bucket_num_entries(new_bucket))++;
+    *hash_bucket_key(destination, entry) = key;
+    *hash_bucket_page(destination, entry) = *hash_bucket_page(bucket, i);
+  }
+  *hash_bucket_num_entries(bucket) = kept;
+
+  for (uint32_t slot = 0; slot < (1u << global_depth); slot++) {
+    if (*hash_directory_slot(directory, slot) == bucket_page_num &&
+        (slot >> depth) & 1) {
+      *hash_directory_slot(directory, slot) = new_page_num;
+    }
+  }
+}
+
+/* Index of the first entry in a bucket with a key of at least key */
+uint32_t hash_bucket_find(void* bucket, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *hash_bucket_num_entries(bucket);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (*hash_bucket_key(bucket, index) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+/* Records that key now lives on the given leaf */
+void hash_index_put(Table* table, uint32_t key, uint32_t leaf_page_num) {
+  HashIndex* index = table->index;
+  if (index == NULL) {
+    return;
+  }
+  while (true) {
+    uint32_t bucket_page_num = hash_index_bucket(index, key);
+    void* bucket = get_page(index->pager, bucket_page_num);
+    uint32_t num_entries = *hash_bucket_num_entries(bucket);
+    uint32_t entry = hash_bucket_find(bucket, key);
+    if (entry < num_entries && *hash_bucket_key(bucket, entry) == key) {
+      *hash_bucket_page(bucket, entry) = leaf_page_num;
+      return;
+    }
+    if (num_entries < HASH_BUCKET_MAX_ENTRIES) {
+      memmove(hash_bucket_key(bucket, entry + 1), hash_bucket_key(bucket, entry),
+              (num_entries - entry) * HASH_ENTRY_SIZE);
+      *hash_bucket_key(bucket, entry) = key;
+      *hash_bucket_page(bucket, entry) = leaf_page_num;
+      *hash_bucket_num_entries(bucket) = num_entries + 1;
+      index->num_keys++;
+      return;
+    }
+    hash_index_split(index, bucket_page_num);
+  }
+}
+
+/* Points every key on a leaf at it, after the leaf's rows moved there */
+void hash_index_put_leaf(Table* table, uint32_t page_num) {
+  if (table->index == NULL) {
+    return;
+  }
+  void* node = get_page(table->pager, page_num);
+  for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+    hash_index_put(table, *leaf_node_key(node, i), page_num);
+  }
+}
+
+/* The stored row with this id found through the index, or NULL */
+void* hash_index_get(Table* table, uint32_t key) {
+  HashIndex* index = table->index;
+  table->stats.index_lookups++;
+  void* bucket = get_page(index->pager, hash_index_bucket(index, key));
+  uint32_t entry = hash_bucket_find(bucket, key);
+  if (entry == *hash_bucket_num_entries(bucket) ||
+      *hash_bucket_key(bucket, entry) != key) {
+    return NULL;
+  }
+  uint32_t page_num = *hash_bucket_page(bucket, entry);
+  void* node = get_page(table->pager, page_num);
+  Cursor* cursor = leaf_node_find(table, page_num, key);
+  void* value = NULL;
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == key) {
+    value = leaf_node_row(node, cursor->cell_num, table->value_buffer);
+  }
+  free(cursor);
+  return value;
+}
+
+/*
+Side files (<db>-hash, <db>-bloom) hold what can be rebuilt from the rows.
+Closing one stamps it with the database's id and LSN; on open it is only
+trusted if they still match, otherwise it was left behind by another file
+or an unclean exit.
+*/
+void side_file_close(Table* table, Pager* side, uint32_t root_page_num) {
+  pager_wait_for_prefetch(side);
+  void* header = get_page(side, HEADER_PAGE_NUM);
+  *header_db_id(header) =
+      *header_db_id(get_page(table->pager, HEADER_PAGE_NUM));
+  side->lsn = table->pager->lsn;
+  pager_checkpoint(side, root_page_num);
+  pager_close(side);
+}
+
+bool side_file_current(Table* table, Pager* side) {
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  void* side_header = get_page(side, HEADER_PAGE_NUM);
+  return *header_root_page_num(side_header) != INVALID_PAGE_NUM &&
+         *header_db_id(side_header) == *header_db_id(header) &&
+         *header_lsn(side_header) == *header_lsn(header);
+}
+
+void hash_index_close(Table* table) {
+  HashIndex* index = table->index;
+  side_file_close(table, index->pager, index->directory_page_num);
+  free(index);
+  table->index = NULL;
+}
+
+void hash_index_drop(Table* table) {
+  if (table->index == NULL) {
+    return;
+  }
+  pager_wait_for_prefetch(table->index->pager);
+  pager_close(table->index->pager);
+  free(table->index);
+  table->index = NULL;
+  unlink(table->index_path);
+}
+
+/* Builds the index from scratch with one pass over the leaves */
+void hash_index_build(Table* table) {
+  hash_index_drop(table);
+  HashIndex* index = malloc(sizeof(HashIndex));
+  index->pager = pager_open(table->index_path);
+  index->directory_page_num = get_unused_page_num(index->pager);
+  void* directory = get_page(index->pager, index->directory_page_num);
+  uint32_t bucket_page_num = get_unused_page_num(index->pager);
+  void* bucket = get_page(index->pager, bucket_page_num);
+  *hash_directory_depth(directory) = 0;
+  *hash_directory_slot(directory, 0) = bucket_page_num;
+  *hash_bucket_depth(bucket) = 0;
+  *hash_bucket_num_entries(bucket) = 0;
+  index->num_keys = 0;
+  table->index = index;
+
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    void* node = get_page(table->pager, cursor->page_num);
+    hash_index_put(table, *leaf_node_key(node, cursor->cell_num),
+                   cursor->page_num);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+}
+
+/* Opens <db>-hash if there is one, rebuilding it if it is stale */
+void hash_index_open(Table* table) {
+  if (access(table->index_path, F_OK) != 0) {
+    return;
+  }
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  if (*header_engine(header) != ENGINE_BTREE) {
+    unlink(table->index_path);
+    return;
+  }
+  HashIndex* index = malloc(sizeof(HashIndex));
+  index->pager = pager_open(table->index_path);
+  index->directory_page_num =
+      *header_root_page_num(get_page(index->pager, HEADER_PAGE_NUM));
+  table->index = index;
+  if (!side_file_current(table, index->pager)) {
+    hash_index_build(table);
+    return;
+  }
+  index->num_keys = 0;
+  void* directory = get_page(index->pager, index->directory_page_num);
+  uint32_t num_slots = 1u << *hash_directory_depth(directory);
+  for (uint32_t slot = 0; slot < num_slots; slot++) {
+    /* A bucket of depth d fills every slot that shares its low d bits */
+    uint32_t bucket_page_num = *hash_directory_slot(directory, slot);
+    void* bucket = get_page(index->pager, bucket_page_num);
+    if (slot < (1u << *hash_bucket_depth(bucket))) {
+      index->num_keys += *hash_bucket_num_entries(bucket);
+    }
+  }
+}
+
+void print_index(Table* table) {
+  HashIndex* index = table->index;
+  if (index == NULL) {
+    printf("Index: none\n");
+    return;
+  }
+  void* directory = get_page(index->pager, index->directory_page_num);
+  printf("Index: hash, %d keys, depth %d, %d buckets\n", index->num_keys,
+         *hash_directory_depth(directory),
+         index->pager->num_pages - index->directory_page_num - 1);
+}
+
+/*
+Table bloom filter. Point lookups ask it first and skip the descent, and
+with it any page reads, for ids it has never seen. The filter lives in
+<db>-bloom in the usual page format, so once its pages are cached a
+negative lookup reads nothing. Ids only ever get added; when there are more
+than the filter was sized for it is rebuilt at twice the size.
+*/
+const uint32_t TABLE_BLOOM_META_PAGE_NUM = 1;
+const uint32_t TABLE_BLOOM_FIRST_BLOCK_PAGE_NUM = 2;
+
+uint32_t* table_bloom_block(TableBloom* bloom, uint32_t block) {
+  void* page = get_page(bloom->pager, TABLE_BLOOM_FIRST_BLOCK_PAGE_NUM +
+                                          block / BLOOM_BLOCKS_PER_PAGE);
+  return page + block % BLOOM_BLOCKS_PER_PAGE * BLOOM_BLOCK_SIZE;
+}
+
+bool table_bloom_may_contain(Table* table, uint32_t key) {
+  TableBloom* bloom = table->bloom;
+  uint64_t hash = key_hash(key);
+  return bloom_block_check(
+      table_bloom_block(bloom, bloom_block_index(hash, bloom->num_blocks)),
+      hash);
+}
+
+uint32_t table_bloom_capacity(TableBloom* bloom) {
+  return (uint64_t)bloom->num_blocks * BLOOM_BLOCK_SIZE * 8 /
+         BLOOM_BITS_PER_KEY;
+}
+
+void table_bloom_drop(Table* table) {
+  if (table->bloom == NULL) {
+    return;
+  }
+  pager_wait_for_prefetch(table->bloom->pager);
+  pager_close(table->bloom->pager);
+  free(table->bloom);
+  table->bloom = NULL;
+  unlink(table->bloom_path);
+}
+
+void table_bloom_close(Table* table) {
+  TableBloom* bloom = table->bloom;
+  void* meta = get_page(bloom->pager, TABLE_BLOOM_META_PAGE_NUM);
+  *(uint32_t*)(meta + BLOOM_NUM_BLOCKS_OFFSET) = bloom->num_blocks;
+  *(uint32_t*)(meta + BLOOM_NUM_KEYS_OFFSET) = bloom->num_keys;
+  side_file_close(table, bloom->pager, TABLE_BLOOM_META_PAGE_NUM);
+  free(bloom);
+  table->bloom = NULL;
+}
+
+/* Sizes a new filter for twice the rows there are now and fills it */
+void table_bloom_build(Table* table) {
+  uint32_t capacity = TABLE_MAX_PAGES * LEAF_NODE_MAX_CELLS;
+  uint32_t* keys = malloc(capacity * sizeof(uint32_t));
+  uint32_t num_keys = 0;
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    Row row;
+    deserialize_row(cursor_value(cursor), &row);
+    keys[num_keys++] = row.id;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  table_bloom_drop(table);
+  TableBloom* bloom = malloc(sizeof(TableBloom));
+  bloom->pager = pager_open(table->bloom_path);
+  uint32_t sized_for = num_keys * 2 > BLOOM_MIN_KEYS ? num_keys * 2
+                                                     : BLOOM_MIN_KEYS;
+  bloom->num_blocks =
+      ((uint64_t)sized_for * BLOOM_BITS_PER_KEY + BLOOM_BLOCK_SIZE * 8 - 1) /
+      (BLOOM_BLOCK_SIZE * 8);
+  bloom->num_keys = 0;
+  table->bloom = bloom;
+  /* Touch the pages in order so page numbers match the layout */
+  get_page(bloom->pager, TABLE_BLOOM_META_PAGE_NUM);
+  for (uint32_t i = 0; i < bloom->num_blocks; i += BLOOM_BLOCKS_PER_PAGE) {
+    table_bloom_block(bloom, i);
+  }
+  for (uint32_t i = 0; i < num_keys; i++) {
+    uint64_t hash = key_hash(keys[i]);
+    bloom_block_add(
+        table_bloom_block(bloom, bloom_block_index(hash, bloom->num_blocks)),
+        hash);
+    bloom->num_keys++;
+  }
+  free(keys);
+}
+
+/* Called after each insert */
+void table_bloom_add(Table* table, uint32_t key) {
+  TableBloom* bloom = table->bloom;
+  if (bloom == NULL) {
+    return;
+  }
+  if (bloom->num_keys >= table_bloom_capacity(bloom)) {
+    /* The new row is already in the table, the rebuild picks it up */
+    table_bloom_build(table);
+    return;
+  }
+  uint64_t hash = key_hash(key);
+  bloom_block_add(
+      table_bloom_block(bloom, bloom_block_index(hash, bloom->num_blocks)),
+      hash);
+  bloom->num_keys++;
+}
+
+/* Opens <db>-bloom if there is one, rebuilding it if it is stale */
+void table_bloom_open(Table* table) {
+  if (access(table->bloom_path, F_OK) != 0) {
+    return;
+  }
+  if (table->lsm != NULL) {
+    unlink(table->bloom_path);
+    return;
+  }
+  TableBloom* bloom = malloc(sizeof(TableBloom));
+  bloom->pager = pager_open(table->bloom_path);
+  table->bloom = bloom;
+  if (!side_file_current(table, bloom->pager)) {
+    table_bloom_build(table);
+    return;
+  }
+  void* meta = get_page(bloom->pager, TABLE_BLOOM_META_PAGE_NUM);
+  bloom->num_blocks = *(uint32_t*)(meta + BLOOM_NUM_BLOCKS_OFFSET);
+  bloom->num_keys = *(uint32_t*)(meta + BLOOM_NUM_KEYS_OFFSET);
+}
+
+void print_bloom(Table* table) {
+  TableBloom* bloom = table->bloom;
+  if (bloom == NULL) {
+    printf("Bloom: none\n");
+    return;
+  }
+  printf("Bloom: %d keys, %d blocks, sized for %d\n", bloom->num_keys,
+         bloom->num_blocks, table_bloom_capacity(bloom));
+}
+
+/*
+Rebuilds the tree from its rows: full leaves on consecutive pages in key
+order, then each level of internal nodes above them. The file is rewritten
+and truncated before returning. Returns the number of rows.
+*/
+uint32_t vacuum_table(Table* table) {
+  Pager* pager = table->pager;
+  bool scrubbing = table->scrub.running;
+  scrub_stop(table);
+  pager_wait_for_prefetch(pager);
+
+  uint32_t num_rows = 0;
+  uint32_t capacity = LEAF_NODE_MAX_CELLS;
+  void* cells = malloc(capacity * LEAF_NODE_CELL_SIZE);
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    if (num_rows == capacity) {
+      capacity *= 2;
+      cells = realloc(cells, capacity * LEAF_NODE_CELL_SIZE);
+    }
+    void* node = get_page(pager, cursor->page_num);
+    void* cell = cells + num_rows * LEAF_NODE_CELL_SIZE;
+    *(uint32_t*)cell = *leaf_node_key(node, cursor->cell_num);
+    memcpy(cell + LEAF_NODE_KEY_SIZE, cursor_value(cursor), ROW_SIZE);
+    num_rows++;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  /* Start over after the header. Nothing on disk past it is read again. */
+  for (uint32_t i = HEADER_PAGE_NUM + 1; i < TABLE_MAX_PAGES; i++) {
+    free(pager->pages[i]);
+    pager->pages[i] = NULL;
+    pager->access_counts[i] = 0;
+  }
+  pager->num_pages = HEADER_PAGE_NUM + 1;
+  if (pager->file_num_pages > pager->num_pages) {
+    pager->file_num_pages = pager->num_pages;
+  }
+
+  uint32_t level_pages[TABLE_MAX_PAGES];
+  uint32_t level_keys[TABLE_MAX_PAGES];
+  uint32_t level_count = 0;
+  uint32_t row = 0;
+  uint32_t layout = *header_layout(get_page(pager, HEADER_PAGE_NUM));
+  do {
+    uint32_t page_num = get_unused_page_num(pager);
+    void* leaf = get_page(pager, page_num);
+    initialize_leaf_node(leaf);
+    leaf_node_set_layout(leaf, layout);
+    uint32_t count = num_rows - row < LEAF_NODE_MAX_CELLS ? num_rows - row
+                                                          : LEAF_NODE_MAX_CELLS;
+    for (uint32_t i = 0; i < count; i++) {
+      void* cell = cells + (row + i) * LEAF_NODE_CELL_SIZE;
+      leaf_node_set_value(leaf, i, *(uint32_t*)cell, cell + LEAF_NODE_KEY_SIZE);
+    }
+    *leaf_node_num_cells(leaf) = count;
+    if (level_count > 0) {
+      void* previous = get_page(pager, level_pages[level_count - 1]);
+      *leaf_node_next_leaf(previous) = page_num;
+    }
+    level_pages[level_count] = page_num;
+    level_keys[level_count] = count > 0 ? *leaf_node_key(leaf, count - 1) : 0;
+    level_count++;
+    row += count;
+  } while (row < num_rows);
+  free(cells);
+
+  while (level_count > 1) {
+    uint32_t num_nodes = (level_count + INTERNAL_NODE_MAX_KEYS) /
+                         (INTERNAL_NODE_MAX_KEYS + 1);
+    uint32_t child = 0;
+    for (uint32_t n = 0; n < num_nodes; n++) {
+      /* Spread the children evenly, so no node is left with just one */
+      uint32_t num_children =
+          (level_count - child + num_nodes - n - 1) / (num_nodes - n);
+      uint32_t page_num = get_unused_page_num(pager);
+      void* node = get_page(pager, page_num);
+      initialize_internal_node(node);
+      for (uint32_t i = 0; i < num_children; i++, child++) {
+        *node_parent(get_page(pager, level_pages[child])) = page_num;
+        if (i == num_children - 1) {
+          *internal_node_right_child(node) = level_pages[child];
+        } else {
+          *internal_node_cell(node, i) = level_pages[child];
+          *internal_node_key(node, i) = level_keys[child];
+        }
+      }
+      *internal_node_num_keys(node) = num_children - 1;
+      level_pages[n] = page_num;
+      level_keys[n] = level_keys[child - 1];
+    }
+    level_count = num_nodes;
+  }
+
+  table->root_page_num = level_pages[0];
+  set_node_root(get_page(pager, table->root_page_num), true);
+  table_checkpoint(table);
+  if (table->index != NULL) {
+    hash_index_build(table);
+  }
+
+  if (scrubbing) {
+    scrub_start(table, table->scrub.pages_per_second);
+  }
+  return num_rows;
+}
+
+/*
+Where every page in the tree is referenced from, found by walking it.
+Leaves are listed in key order.
+*/
+typedef struct {
+  uint32_t parent[TABLE_MAX_PAGES];         // INVALID_PAGE_NUM for the root
+  uint32_t previous_leaf[TABLE_MAX_PAGES];  // 0 for the first leaf
+  uint32_t leaves[TABLE_MAX_PAGES];
+  uint32_t num_leaves;
+} PageMap;
+
+void map_pages(Table* table, PageMap* map, uint32_t page_num,
+               uint32_t parent_page_num) {
+  void* node = get_page(table->pager, page_num);
+  map->parent[page_num] = parent_page_num;
+  if (get_node_type(node) == NODE_LEAF) {
+    map->previous_leaf[page_num] =
+        map->num_leaves > 0 ? map->leaves[map->num_leaves - 1] : 0;
+    map->leaves[map->num_leaves] = page_num;
+    map->num_leaves++;
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    map_pages(table, map, *internal_node_child(node, i), page_num);
+  }
+}
+
+/* A page number stored at offset in another page */
+typedef struct {
+  uint32_t page_num;
+  uint32_t offset;
+} PageReference;
+
+#define MAX_PAGE_REFERENCES (INTERNAL_NODE_MAX_KEYS + 3)
+
+uint32_t find_page_references(Table* table, PageMap* map, uint32_t page_num,
+                              PageReference* references) {
+  uint32_t count = 0;
+  uint32_t parent_page_num = map->parent[page_num];
+  if (parent_page_num != INVALID_PAGE_NUM) {
+    void* parent = get_page(table->pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t offset = INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+    for (uint32_t i = 0; i < num_keys; i++) {
+      if (*internal_node_cell(parent, i) == page_num) {
+        offset = (void*)internal_node_cell(parent, i) - parent;
+      }
+    }
+    references[count++] = (PageReference){parent_page_num, offset};
+  }
+
+  void* node = get_page(table->pager, page_num);
+  if (get_node_type(node) == NODE_LEAF) {
+    if (map->previous_leaf[page_num] != 0) {
+      references[count++] = (PageReference){map->previous_leaf[page_num],
+                                             LEAF_NODE_NEXT_LEAF_OFFSET};
+    }
+    return count;
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    references[count++] =
+        (PageReference){*internal_node_child(node, i), PARENT_POINTER_OFFSET};
+  }
+  return count;
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+/*
+Exchanges two pages of the tree and repoints everything that referred to
+either of them: parents, children, the previous leaf and the root.
+*/
+void swap_pages(Table* table, PageMap* map, uint32_t a, uint32_t b) {
+  Pager* pager = table->pager;
+  PageReference references[2 * MAX_PAGE_REFERENCES];
+  uint32_t count = find_page_references(table, map, a, references);
+  count += find_page_references(table, map, b, references + count);
+
+  void* page_a = get_page(pager, a);
+  void* page_b = get_page(pager, b);
+  pager->pages[a] = page_b;
+  pager->pages[b] = page_a;
+  uint32_t access_count = pager->access_counts[a];
+  pager->access_counts[a] = pager->access_counts[b];
+  pager->access_counts[b] = access_count;
+  /* Same contents at a new page number is still a change, for backups */
+  set_page_lsn(page_a, pager->lsn);
+  update_page_checksum(page_a);
+  set_page_lsn(page_b, pager->lsn);
+  update_page_checksum(page_b);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t host = references[i].page_num;
+    host = host == a ? b : host == b ? a : host;
+    uint32_t* value = get_page(pager, host) + references[i].offset;
+    *value = *value == a ? b : a;
+  }
+  if (table->root_page_num == a) {
+    table->root_page_num = b;
+  } else if (table->root_page_num == b) {
+    table->root_page_num = a;
+  }
+  if (get_node_type(page_a) == NODE_LEAF) {
+    hash_index_put_leaf(table, b);
+  }
+  if (get_node_type(page_b) == NODE_LEAF) {
+    hash_index_put_leaf(table, a);
+  }
+}
 
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+/*
+Moves up to max_moves leaves so that leaves sit on consecutive pages in key
+order, straight after the header. Each move swaps a leaf with whatever page
+holds its place. Sets *moved and returns the leaves still out of place.
+*/
+uint32_t defrag_table(Table* table, uint32_t max_moves, uint32_t* moved) {
+  PageMap* map = malloc(sizeof(PageMap));
+  *moved = 0;
+  while (true) {
+    map->num_leaves = 0;
+    map_pages(table, map, table->root_page_num, INVALID_PAGE_NUM);
+
+    uint32_t out_of_place = 0;
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < map->num_leaves; i++) {
+      if (map->leaves[i] != HEADER_PAGE_NUM + 1 + i) {
+        if (out_of_place == 0) {
+          first = i;
+        }
+        out_of_place++;
+      }
+    }
+    if (out_of_place == 0 || *moved == max_moves) {
+      free(map);
+      return out_of_place;
+    }
+    swap_pages(table, map, map->leaves[first], HEADER_PAGE_NUM + 1 + first);
+    (*moved)++;
   }
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+void write_latency_report(FILE* out, Table* table) {
+  write_histogram(out, "prepare", &table->latency.prepare);
+  write_histogram(out, "insert", &table->latency.insert);
+  write_histogram(out, "select", &table->latency.select);
+  write_histogram(out, "update", &table->latency.update);
+  write_histogram(out, "flush", &table->pager->flush_latency);
+}
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+void dump_latency(Table* table) {
+  FILE* out = fopen(table->latency.dump_path, "a");
+  if (out == NULL) {
+    printf("Unable to open latency dump file\n");
+    return;
+  }
+  fprintf(out, "# %ld\n", (long)time(NULL));
+  write_latency_report(out, table);
+  fclose(out);
+  table->latency.last_dump_ns = monotonic_ns();
+}
+
+/* Called at statement boundaries; the REPL has no timer thread */
+void maybe_dump_latency(Table* table) {
+  if (table->latency.dump_path == NULL) {
+    return;
+  }
+  uint64_t interval_ns =
+      (uint64_t)table->latency.dump_interval_seconds * 1000000000;
+  if (monotonic_ns() - table->latency.last_dump_ns >= interval_ns) {
+    dump_latency(table);
   }
 }
 
 void db_close(Table* table) {
   Pager* pager = table->pager;
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  scrub_stop(table);
+  if (table->lsm != NULL) {
+    lsm_close(table);
+  }
+  if (table->backup != NULL) {
+    backup_finish(table);
+    backup_free(table);
+  }
+  pager_wait_for_prefetch(pager);
+  pager_save_hot_pages(pager);
+  table_checkpoint(table);
+  if (table->index != NULL) {
+    hash_index_close(table);
+  }
+  if (table->bloom != NULL) {
+    table_bloom_close(table);
+  }
+  if (table->row_cache != NULL) {
+    row_cache_free(table->row_cache);
+  }
+  if (table->query_cache != NULL) {
+    query_cache_free(table->query_cache);
+  }
+  if (table->replication != NULL) {
+    replication_free(table);
+  }
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    db_close(table->partitions[i]);
+  }
+  free(table->partitions);
+
+  if (table->latency.dump_path != NULL) {
+    dump_latency(table);
+    free(table->latency.dump_path);
+  }
+
+  pager_close(pager);
+  free(table->index_path);
+  free(table->bloom_path);
+  free(table->log_path);
+  free(table->filename);
+  free(table->value_buffer);
+  free(table);
+}
+
+const char* statement_type_name(StatementType type) {
+  switch (type) {
+    case (STATEMENT_INSERT):
+      return "insert";
+    case (STATEMENT_SELECT):
+      return "select";
+    case (STATEMENT_UPDATE):
+      return "update";
+  }
+  return "unknown";
+}
+
+/* Removes a database file and the side files kept next to it */
+void unlink_database(const char* path) {
+  const char* suffixes[] = {"", "-hot", "-hash", "-bloom", "-log"};
+  char* side_path = malloc(strlen(path) + sizeof("-bloom"));
+  for (uint32_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    sprintf(side_path, "%s%s", path, suffixes[i]);
+    unlink(side_path);
+  }
+  free(side_path);
+}
+
+char* partition_path(Table* table, uint32_t partition) {
+  char* path = malloc(strlen(table->filename) + sizeof("-part") + 10);
+  sprintf(path, "%s-part%d", table->filename, partition);
+  return path;
+}
+
+/* Opens the partition files the header lists, each as a table of its own */
+void partitions_open(Table* table) {
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  table->partition_scheme = *header_partition_scheme(header);
+  table->partition_width = *header_partition_width(header);
+  table->num_partitions = *header_num_partitions(header);
+  table->partitions = NULL;
+  if (table->num_partitions == 0) {
+    return;
+  }
+  table->partitions = malloc(sizeof(Table*) * table->num_partitions);
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    char* path = partition_path(table, i);
+    table->partitions[i] = db_open(path);
+    free(path);
+  }
+}
+
+uint32_t table_partition_index(Table* table, uint32_t key) {
+  if (table->partition_scheme == PARTITION_HASH) {
+    return key_hash(key) % table->num_partitions;
+  }
+  uint32_t index = key / table->partition_width;
+  return index < table->num_partitions ? index : table->num_partitions - 1;
+}
+
+/* The table holding key: its partition, or itself if it isn't partitioned */
+Table* table_partition(Table* table, uint32_t key) {
+  if (table->num_partitions == 0) {
+    return table;
+  }
+  return table->partitions[table_partition_index(table, key)];
+}
+
+/*
+Splits an empty table into count new partition files. Returns false if the
+table has rows or is already partitioned.
+*/
+bool table_partition_into(Table* table, PartitionScheme scheme,
+                          uint32_t count, uint32_t width) {
+  if (table->num_partitions > 0 || !table_is_empty(table)) {
+    return false;
+  }
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  *header_partition_scheme(header) = scheme;
+  *header_num_partitions(header) = count;
+  *header_partition_width(header) = width;
+  for (uint32_t i = 0; i < count; i++) {
+    /* Don't pick up rows a file of the same name was left holding */
+    char* path = partition_path(table, i);
+    unlink_database(path);
+    free(path);
+  }
+  partitions_open(table);
+  return true;
+}
+
+/* False when no id in a range partition can satisfy the predicate */
+bool partition_may_match(Table* table, uint32_t partition, Predicate* where) {
+  if (table->partition_scheme != PARTITION_RANGE || !where->active ||
+      where->column != COLUMN_ID) {
+    return true;
+  }
+  uint64_t low = (uint64_t)partition * table->partition_width;
+  uint64_t high = partition == table->num_partitions - 1
+                      ? UINT32_MAX
+                      : low + table->partition_width - 1;
+  switch (where->comparison) {
+    case COMPARE_EQUAL:
+      return low <= where->id && where->id <= high;
+    case COMPARE_LESS:
+      return low < where->id;
+    case COMPARE_LESS_EQUAL:
+      return low <= where->id;
+    case COMPARE_GREATER:
+      return high > where->id;
+    case COMPARE_GREATER_EQUAL:
+      return high >= where->id;
+  }
+  return true;
+}
+
+void print_replication_stats(Replication* replication) {
+  printf("replication_lsn: %" PRIu64 "\n", replication->lsn);
+  if (replication->role == REPLICATION_FOLLOWER) {
+    printf("replication_lag_records: %" PRIu64 "\n",
+           log_num_records(replication->file_descriptor) - replication->lsn);
+    printf("replication_lag_us: %" PRIu64 "\n", replication->lag_ns / 1000);
+  }
+}
+
+void print_row_cache_stats(RowCache* cache) {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  for (uint32_t i = 0; i < ROW_CACHE_SHARDS; i++) {
+    RowCacheShard* shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    hits += shard->hits;
+    misses += shard->misses;
+    evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  printf("row_cache_hits: %" PRIu64 "\n", hits);
+  printf("row_cache_misses: %" PRIu64 "\n", misses);
+  printf("row_cache_evictions: %" PRIu64 "\n", evictions);
+}
+
+void print_query_cache_stats(QueryCache* cache) {
+  printf("query_cache_hits: %" PRIu64 "\n", cache->hits);
+  printf("query_cache_misses: %" PRIu64 "\n", cache->misses);
+}
+
+void print_lsm_stats(Table* table, PagerStats* pager_stats,
+                     TableStats* table_stats) {
+  Lsm* lsm = table->lsm;
+  void* manifest = get_page(table->pager, table->root_page_num);
+  printf("cache_hits: %" PRIu64 "\n", pager_stats->cache_hits);
+  printf("cache_misses: %" PRIu64 "\n", pager_stats->cache_misses);
+  printf("pages_read: %" PRIu64 "\n", pager_stats->pages_read);
+  printf("pages_written: %" PRIu64 "\n", pager_stats->pages_written);
+  printf("pages_prefetched: %" PRIu64 "\n", pager_stats->pages_prefetched);
+  printf("memtable_rows: %d\n", lsm->memtable.num_rows);
+  printf("lsm_runs: %d\n", *lsm_manifest_num_runs(manifest));
+  printf("lsm_free_pages: %d\n", *lsm_manifest_num_free(manifest));
+  printf("lsm_flushes: %" PRIu64 "\n", lsm->flushes);
+  printf("lsm_compactions: %" PRIu64 "\n", lsm->compactions);
+  printf("lsm_bloom_skips: %" PRIu64 "\n", lsm->bloom_skips);
+  printf("lsm_write_amplification: %.2f\n",
+         lsm->rows_put > 0 ? (double)lsm->rows_written / lsm->rows_put : 0);
+  if (table->row_cache != NULL) {
+    print_row_cache_stats(table->row_cache);
+  }
+  if (table->replication != NULL) {
+    print_replication_stats(table->replication);
+  }
+  if (table->query_cache != NULL) {
+    print_query_cache_stats(table->query_cache);
+  }
+  printf("rows_scanned: %" PRIu64 "\n", table_stats->rows_scanned);
+  for (uint32_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+    printf("statements_%s: %" PRIu64 "\n", statement_type_name(i),
+           table_stats->statements[i]);
+  }
+}
+
+void print_stats(Table* table) {
+  /* Snapshot the counters first, the tree walk below goes through get_page */
+  PagerStats pager_stats = table->pager->stats;
+  pager_stats.pages_prefetched =
+      __atomic_load_n(&table->pager->stats.pages_prefetched, __ATOMIC_RELAXED);
+  TableStats table_stats = table->stats;
+
+  if (table->lsm != NULL) {
+    print_lsm_stats(table, &pager_stats, &table_stats);
+    return;
+  }
+
+  void* root = get_page(table->pager, table->root_page_num);
+  uint32_t tree_height = get_node_height(table->pager, root) + 1;
+
+  uint32_t page_num = table->root_page_num;
+  void* node = root;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    page_num = *internal_node_child(node, 0);
+    node = get_page(table->pager, page_num);
+  }
+  uint32_t num_leaves = 0;
+  uint64_t num_cells = 0;
+  while (true) {
+    num_leaves++;
+    num_cells += *leaf_node_num_cells(node);
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0) {
+      break;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    node = get_page(table->pager, page_num);
   }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  printf("cache_hits: %" PRIu64 "\n", pager_stats.cache_hits);
+  printf("cache_misses: %" PRIu64 "\n", pager_stats.cache_misses);
+  printf("pages_read: %" PRIu64 "\n", pager_stats.pages_read);
+  printf("pages_written: %" PRIu64 "\n", pager_stats.pages_written);
+  printf("pages_prefetched: %" PRIu64 "\n", pager_stats.pages_prefetched);
+  for (uint32_t i = 0; i < tree_height && i < STATS_MAX_LEVELS; i++) {
+    printf("splits_level_%d: %" PRIu64 "\n", i, table_stats.splits[i]);
+  }
+  printf("tree_height: %d\n", tree_height);
+  printf("leaf_nodes: %d\n", num_leaves);
+  printf("leaf_fill_factor: %.2f\n",
+         (double)num_cells / (num_leaves * LEAF_NODE_MAX_CELLS));
+  printf("leaves_skipped: %" PRIu64 "\n", table_stats.leaves_skipped);
+  if (table->index != NULL) {
+    printf("index_lookups: %" PRIu64 "\n", table_stats.index_lookups);
+  }
+  if (table->bloom != NULL) {
+    printf("bloom_negatives: %" PRIu64 "\n", table_stats.bloom_negatives);
+    printf("bloom_false_positives: %" PRIu64 "\n",
+           table_stats.bloom_false_positives);
+  }
+  if (table->betree) {
+    printf("buffered_rows: %" PRIu64 "\n",
+           betree_buffered_rows(table->pager, table->root_page_num));
+    printf("buffer_flushes: %" PRIu64 "\n", table_stats.buffer_flushes);
+    printf("rows_per_leaf_write: %.2f\n",
+           table_stats.leaf_batches == 0
+               ? 0.0
+               : (double)table_stats.leaf_batch_rows / table_stats.leaf_batches);
+  }
+  if (table->row_cache != NULL) {
+    print_row_cache_stats(table->row_cache);
+  }
+  if (table->replication != NULL) {
+    print_replication_stats(table->replication);
+  }
+  if (table->query_cache != NULL) {
+    print_query_cache_stats(table->query_cache);
+  }
+  printf("rows_scanned: %" PRIu64 "\n", table_stats.rows_scanned);
+  for (uint32_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+    printf("statements_%s: %" PRIu64 "\n", statement_type_name(i),
+           table_stats.statements[i]);
+  }
+}
+
+MetaCommandResult do_latency_command(InputBuffer* input_buffer, Table* table) {
+  if (strcmp(input_buffer->buffer, ".latency") == 0) {
+    printf("Latency:\n");
+    write_latency_report(stdout, table);
+    return META_COMMAND_SUCCESS;
+  }
+
+  char path[256];
+  uint32_t seconds = LATENCY_DUMP_DEFAULT_INTERVAL;
+  if (sscanf(input_buffer->buffer, ".latency dump %255s %u", path, &seconds) >=
+      1) {
+    free(table->latency.dump_path);
+    table->latency.dump_path = strdup(path);
+    table->latency.dump_interval_seconds = seconds;
+    table->latency.last_dump_ns = monotonic_ns();
+    printf("Dumping latency to %s every %d seconds.\n", path, seconds);
+    return META_COMMAND_SUCCESS;
+  }
+
+  return META_COMMAND_UNRECOGNIZED_COMMAND;
+}
+
+MetaCommandResult do_checksums_command(InputBuffer* input_buffer,
+                                       Table* table) {
+  Pager* pager = table->pager;
+  if (strcmp(input_buffer->buffer, ".checksums read") == 0) {
+    pager->checksum_mode = CHECKSUM_VERIFY_ON_READ;
+  } else if (strcmp(input_buffer->buffer, ".checksums scrub") == 0) {
+    pager->checksum_mode = CHECKSUM_VERIFY_ON_SCRUB;
+  } else if (strcmp(input_buffer->buffer, ".checksums") != 0) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  printf("Checksums: verify on %s (%s)\n",
+         pager->checksum_mode == CHECKSUM_VERIFY_ON_READ ? "read" : "scrub",
+         crc32c_hardware ? "sse4.2" : "software");
+  return META_COMMAND_SUCCESS;
+}
+
+void print_check(Table* table) {
+  Checker* checker = malloc(sizeof(Checker));
+  checker_init(checker, table->pager, false, 0, NULL);
+  checker->out = stdout;
+  check_database(checker, table->root_page_num);
+  printf("Check: %d pages, %d errors\n", checker->pages_checked,
+         checker->errors);
+  free(checker);
+}
+
+MetaCommandResult do_scrub_command(InputBuffer* input_buffer, Table* table) {
+  Scrubber* scrub = &table->scrub;
+  uint32_t pages_per_second = SCRUB_DEFAULT_PAGES_PER_SECOND;
+  if (strcmp(input_buffer->buffer, ".scrub stop") == 0) {
+    scrub_stop(table);
+    printf("Scrub stopped.\n");
+    return META_COMMAND_SUCCESS;
+  }
+  if (strcmp(input_buffer->buffer, ".scrub") == 0 ||
+      strcmp(input_buffer->buffer, ".scrub status") == 0) {
+    pthread_mutex_lock(&scrub->lock);
+    printf("Scrub:\n");
+    printf("running: %s\n", scrub->running ? "yes" : "no");
+    printf("pages_per_second: %d\n", scrub->pages_per_second);
+    printf("passes: %" PRIu64 "\n", scrub->passes);
+    printf("pages_checked: %" PRIu64 "\n", scrub->pages_checked);
+    printf("errors: %d\n", scrub->errors);
+    if (scrub->errors > 0) {
+      printf("last_error: %s\n", scrub->last_error);
+    }
+    pthread_mutex_unlock(&scrub->lock);
+    return META_COMMAND_SUCCESS;
+  }
+  if (strcmp(input_buffer->buffer, ".scrub start") == 0 ||
+      (sscanf(input_buffer->buffer, ".scrub start %u", &pages_per_second) ==
+           1 &&
+       pages_per_second > 0)) {
+    scrub_start(table, pages_per_second);
+    printf("Scrubbing at %d pages/sec.\n", pages_per_second);
+    return META_COMMAND_SUCCESS;
+  }
+
+  return META_COMMAND_UNRECOGNIZED_COMMAND;
+}
+
+void print_row_cache(Table* table) {
+  RowCache* cache = table->row_cache;
+  if (cache == NULL) {
+    printf("Row cache: off\n");
+    return;
+  }
+  uint32_t num_rows = 0;
+  for (uint32_t i = 0; i < ROW_CACHE_SHARDS; i++) {
+    RowCacheShard* shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    for (uint32_t j = 0; j < shard->num_used; j++) {
+      num_rows += shard->slots[j].used;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  printf("Row cache: %d rows, capacity %d\n", num_rows, cache->capacity);
+}
+
+MetaCommandResult do_row_cache_command(InputBuffer* input_buffer,
+                                       Table* table) {
+  uint32_t capacity;
+  if (strcmp(input_buffer->buffer, ".rowcache off") == 0) {
+    if (table->row_cache != NULL) {
+      row_cache_free(table->row_cache);
+      table->row_cache = NULL;
+    }
+  } else if (sscanf(input_buffer->buffer, ".rowcache %u", &capacity) == 1 &&
+             capacity > 0) {
+    if (table->row_cache != NULL) {
+      row_cache_free(table->row_cache);
+    }
+    table->row_cache = row_cache_new(capacity);
+  } else if (strcmp(input_buffer->buffer, ".rowcache") != 0) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  print_row_cache(table);
+  return META_COMMAND_SUCCESS;
+}
+
+MetaCommandResult do_query_cache_command(InputBuffer* input_buffer,
+                                         Table* table) {
+  if (strcmp(input_buffer->buffer, ".querycache on") == 0) {
+    if (table->query_cache == NULL) {
+      table->query_cache = calloc(1, sizeof(QueryCache));
+    }
+  } else if (strcmp(input_buffer->buffer, ".querycache off") == 0) {
+    if (table->query_cache != NULL) {
+      query_cache_free(table->query_cache);
+      table->query_cache = NULL;
+    }
+  } else if (strcmp(input_buffer->buffer, ".querycache") != 0) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  QueryCache* cache = table->query_cache;
+  if (cache == NULL) {
+    printf("Query cache: off\n");
+    return META_COMMAND_SUCCESS;
+  }
+  uint32_t num_results = 0;
+  size_t num_bytes = 0;
+  for (uint32_t i = 0; i < QUERY_CACHE_SLOTS; i++) {
+    QueryCacheEntry* entry = &cache->entries[i];
+    if (entry->used && entry->version == table->version) {
+      num_results++;
+      num_bytes += entry->length;
+    }
+  }
+  printf("Query cache: %d results, %zu bytes\n", num_results, num_bytes);
+  return META_COMMAND_SUCCESS;
+}
+
+MetaCommandResult do_backup_command(InputBuffer* input_buffer, Table* table) {
+  if (strcmp(input_buffer->buffer, ".backup wait") == 0) {
+    if (table->backup == NULL) {
+      printf("No backup in progress.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    Backup* backup = table->backup;
+    uint64_t lsn = backup_finish(table);
+    printf("Backup to %s complete at LSN %" PRIu64
+           ": %d pages copied, %d recopied, %d unchanged.\n",
+           backup->path, lsn, backup->pages_copied, backup->pages_recopied,
+           backup->pages_unchanged);
+    backup_free(table);
+    return META_COMMAND_SUCCESS;
+  }
+
+  char path[256];
+  if (sscanf(input_buffer->buffer, ".backup %255s", path) == 1) {
+    if (table->backup != NULL) {
+      printf("Backup to %s already in progress.\n", table->backup->path);
+      return META_COMMAND_SUCCESS;
+    }
+    if (!backup_begin(table, path)) {
+      printf("Error: Unable to open backup file %s: %s\n", path,
+             strerror(errno));
+      return META_COMMAND_SUCCESS;
+    }
+    if (table->backup->since_lsn > 0) {
+      printf("Backing up to %s, pages changed since LSN %" PRIu64 ".\n", path,
+             table->backup->since_lsn);
+    } else {
+      printf("Backing up to %s, all pages.\n", path);
+    }
+    return META_COMMAND_SUCCESS;
+  }
+
+  return META_COMMAND_UNRECOGNIZED_COMMAND;
+}
+
+void print_replication(Table* table) {
+  Replication* replication = table->replication;
+  if (replication == NULL) {
+    printf("Replication: off\n");
+  } else if (replication->role == REPLICATION_PRIMARY) {
+    printf("Replication: primary, lsn %" PRIu64 "\n", replication->lsn);
+  } else {
+    uint64_t num_records = log_num_records(replication->file_descriptor);
+    printf("Replication: following %s, lsn %" PRIu64 " of %" PRIu64
+           ", lag %.3f ms\n",
+           replication->primary_path, replication->lsn, num_records,
+           replication->lag_ns / 1e6);
+  }
+}
+
+MetaCommandResult do_primary_command(InputBuffer* input_buffer, Table* table) {
+  if (strcmp(input_buffer->buffer, ".primary") == 0) {
+    if (replication_is_follower(table)) {
+      printf("Error: Following %s.\n", table->replication->primary_path);
+      return META_COMMAND_SUCCESS;
+    }
+    if (table->replication == NULL) {
+      replication_start_primary(table);
+    }
+  } else if (strcmp(input_buffer->buffer, ".primary off") == 0) {
+    if (table->replication != NULL && !replication_is_follower(table)) {
+      replication_stop_primary(table);
+    }
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  print_replication(table);
+  return META_COMMAND_SUCCESS;
+}
+
+/* A follower replays the primary's log from the start, so it begins empty */
+MetaCommandResult do_follow_command(InputBuffer* input_buffer, Table* table) {
+  char path[256];
+  if (strcmp(input_buffer->buffer, ".follow off") == 0) {
+    if (replication_is_follower(table)) {
+      replication_free(table);
+    }
+  } else if (sscanf(input_buffer->buffer, ".follow %255s", path) == 1) {
+    if (table->replication != NULL) {
+      print_replication(table);
+      return META_COMMAND_SUCCESS;
+    }
+    if (!table_is_empty(table)) {
+      printf("Error: Table is not empty.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (!replication_follow(table, path)) {
+      printf("Error: %s has no log, run .primary there first.\n", path);
+      return META_COMMAND_SUCCESS;
+    }
+    replication_poll(table);
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  print_replication(table);
+  return META_COMMAND_SUCCESS;
+}
+
+const char* partition_scheme_name(PartitionScheme scheme) {
+  return scheme == PARTITION_HASH ? "hash" : "range";
+}
+
+void print_partitions(Table* table) {
+  if (table->num_partitions == 0) {
+    printf("Partitions: none\n");
+    return;
+  }
+  printf("Partitions: %d by %s", table->num_partitions,
+         partition_scheme_name(table->partition_scheme));
+  if (table->partition_scheme == PARTITION_RANGE) {
+    printf(", %d ids each", table->partition_width);
+  }
+  printf("\n");
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    Table* partition = table->partitions[i];
+    Cursor* cursor = table_start(partition);
+    uint32_t num_rows = 0;
+    while (!cursor->end_of_table) {
+      num_rows++;
+      cursor_advance(cursor);
+    }
+    free(cursor);
+    printf("- partition %d: %d rows, %d pages\n", i, num_rows,
+           partition->pager->num_pages);
+  }
+}
+
+MetaCommandResult do_partition_command(InputBuffer* input_buffer,
+                                       Table* table) {
+  uint32_t count;
+  uint32_t width = 0;
+  PartitionScheme scheme;
+  if (strcmp(input_buffer->buffer, ".partition") == 0) {
+    print_partitions(table);
+    return META_COMMAND_SUCCESS;
+  } else if (sscanf(input_buffer->buffer, ".partition hash %u", &count) == 1) {
+    scheme = PARTITION_HASH;
+  } else if (sscanf(input_buffer->buffer, ".partition range %u %u", &count,
+                    &width) == 2 &&
+             width > 0) {
+    scheme = PARTITION_RANGE;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  if (count < 2 || count > MAX_PARTITIONS) {
+    printf("Error: Between 2 and %d partitions.\n", MAX_PARTITIONS);
+    return META_COMMAND_SUCCESS;
+  }
+  if (!table_partition_into(table, scheme, count, width)) {
+    printf("Error: Table is not empty.\n");
+    return META_COMMAND_SUCCESS;
+  }
+  print_partitions(table);
+  return META_COMMAND_SUCCESS;
+}
+
+/* Commands about a table's tree, which a partitioned table runs on each */
+bool partition_forwards(const char* command) {
+  const char* forwarded[] = {".btree",  ".stats", ".check",  ".vacuum",
+                             ".defrag", ".engine", ".layout", ".index",
+                             ".bloom",  ".rowcache"};
+  for (uint32_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+    if (strncmp(command, forwarded[i], strlen(forwarded[i])) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+Switches an empty table to another engine, reusing its root page. Returns
+false if the table has rows.
+*/
+bool table_set_engine(Table* table, Engine engine) {
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  if (*header_engine(header) == engine) {
+    return true;
+  }
+  Cursor* cursor = table_start(table);
+  bool empty = cursor->end_of_table;
+  free(cursor);
+  if (!empty) {
+    return false;
+  }
+
+  void* root = get_page(table->pager, table->root_page_num);
+  if (table->lsm != NULL) {
+    lsm_close(table);
+  }
+  if (engine == ENGINE_LSM) {
+    initialize_lsm_manifest(root);
+    table->lsm = lsm_new();
+    /* Runs are written as rows */
+    *header_layout(header) = LAYOUT_ROW;
+  } else {
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    leaf_node_set_layout(root, *header_layout(header));
+  }
+  table->betree = engine == ENGINE_BETREE;
+  if (engine != ENGINE_BTREE) {
+    hash_index_drop(table);
+  }
+  if (engine == ENGINE_LSM) {
+    table_bloom_drop(table);
+  }
+  *header_engine(header) = engine;
+  return true;
+}
+
+const char* engine_name(Engine engine) {
+  switch (engine) {
+    case ENGINE_LSM:
+      return "lsm";
+    case ENGINE_BETREE:
+      return "betree";
+    default:
+      return "btree";
+  }
+}
+
+MetaCommandResult do_engine_command(InputBuffer* input_buffer, Table* table) {
+  Engine engine;
+  if (strcmp(input_buffer->buffer, ".engine") == 0) {
+    engine = *header_engine(get_page(table->pager, HEADER_PAGE_NUM));
+  } else if (strcmp(input_buffer->buffer, ".engine btree") == 0) {
+    engine = ENGINE_BTREE;
+  } else if (strcmp(input_buffer->buffer, ".engine betree") == 0) {
+    engine = ENGINE_BETREE;
+  } else if (strcmp(input_buffer->buffer, ".engine lsm") == 0) {
+    engine = ENGINE_LSM;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  if (!table_set_engine(table, engine)) {
+    printf("Error: Table is not empty.\n");
+    return META_COMMAND_SUCCESS;
+  }
+  printf("Engine: %s\n", engine_name(engine));
+  return META_COMMAND_SUCCESS;
+}
+
+const char* layout_name(LeafLayout layout) {
+  switch (layout) {
+    case LAYOUT_PAX:
+      return "pax";
+    case LAYOUT_DICT:
+      return "dict";
+    default:
+      return "row";
+  }
+}
+
+/* Changing the layout rewrites every leaf, through a vacuum */
+MetaCommandResult do_layout_command(InputBuffer* input_buffer, Table* table) {
+  void* header = get_page(table->pager, HEADER_PAGE_NUM);
+  LeafLayout layout;
+  if (strcmp(input_buffer->buffer, ".layout") == 0) {
+    layout = *header_layout(header);
+  } else if (strcmp(input_buffer->buffer, ".layout row") == 0) {
+    layout = LAYOUT_ROW;
+  } else if (strcmp(input_buffer->buffer, ".layout pax") == 0) {
+    layout = LAYOUT_PAX;
+  } else if (strcmp(input_buffer->buffer, ".layout dict") == 0) {
+    layout = LAYOUT_DICT;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+  if (layout != *header_layout(header)) {
+    if (table->lsm != NULL) {
+      printf("Not supported by the lsm engine.\n");
+      return META_COMMAND_SUCCESS;
     }
+    *header_layout(header) = layout;
+    vacuum_table(table);
   }
-  free(pager);
-  free(table);
+  printf("Layout: %s\n", layout_name(layout));
+  return META_COMMAND_SUCCESS;
+}
+
+#define DEFRAG_DEFAULT_MOVES 16
+
+MetaCommandResult do_defrag_command(InputBuffer* input_buffer, Table* table) {
+  uint32_t max_moves = DEFRAG_DEFAULT_MOVES;
+  if (strcmp(input_buffer->buffer, ".defrag") != 0 &&
+      sscanf(input_buffer->buffer, ".defrag %u", &max_moves) != 1) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  uint32_t moved;
+  uint32_t out_of_place = defrag_table(table, max_moves, &moved);
+  printf("Defrag: moved %d leaves, %d out of place.\n", moved, out_of_place);
+  return META_COMMAND_SUCCESS;
 }
 
 MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
@@ -590,22 +5339,115 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
     close_input_buffer(input_buffer);
     db_close(table);
     exit(EXIT_SUCCESS);
+  } else if (strncmp(input_buffer->buffer, ".partition", 10) == 0) {
+    return do_partition_command(input_buffer, table);
+  } else if (table->num_partitions > 0 &&
+             partition_forwards(input_buffer->buffer)) {
+    for (uint32_t i = 0; i < table->num_partitions; i++) {
+      printf("Partition %d:\n", i);
+      if (do_meta_command(input_buffer, table->partitions[i]) ==
+          META_COMMAND_UNRECOGNIZED_COMMAND) {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+      }
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (table->num_partitions > 0 &&
+             (strncmp(input_buffer->buffer, ".backup", 7) == 0 ||
+              strncmp(input_buffer->buffer, ".scrub", 6) == 0)) {
+    printf("Not supported on a partitioned table.\n");
+    return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
     printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    if (table->lsm != NULL) {
+      printf("- memtable (size %d)\n", table->lsm->memtable.num_rows);
+    }
+    print_tree(table->pager, table->root_page_num, 0);
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
     printf("Constants:\n");
     print_constants();
     return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    printf("Stats:\n");
+    print_stats(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".latency", 8) == 0) {
+    return do_latency_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".checksums", 10) == 0) {
+    return do_checksums_command(input_buffer, table);
+  } else if (strcmp(input_buffer->buffer, ".check") == 0) {
+    print_check(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".scrub", 6) == 0) {
+    return do_scrub_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".backup", 7) == 0) {
+    return do_backup_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".primary", 8) == 0) {
+    return do_primary_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".follow", 7) == 0) {
+    return do_follow_command(input_buffer, table);
+  } else if (strcmp(input_buffer->buffer, ".replication") == 0) {
+    print_replication(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".bloom") == 0) {
+    print_bloom(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".bloom on") == 0) {
+    if (table->lsm != NULL) {
+      printf("Not supported by the lsm engine, its runs have filters.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    table_bloom_build(table);
+    print_bloom(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".bloom off") == 0) {
+    table_bloom_drop(table);
+    print_bloom(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".rowcache", 9) == 0) {
+    return do_row_cache_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".querycache", 11) == 0) {
+    return do_query_cache_command(input_buffer, table);
+  } else if (strcmp(input_buffer->buffer, ".index") == 0) {
+    print_index(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".index hash") == 0) {
+    Engine engine = *header_engine(get_page(table->pager, HEADER_PAGE_NUM));
+    if (engine != ENGINE_BTREE) {
+      printf("Not supported by the %s engine.\n", engine_name(engine));
+      return META_COMMAND_SUCCESS;
+    }
+    hash_index_build(table);
+    print_index(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".index drop") == 0) {
+    hash_index_drop(table);
+    print_index(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".engine", 7) == 0) {
+    return do_engine_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".layout", 7) == 0) {
+    return do_layout_command(input_buffer, table);
+  } else if (table->lsm != NULL &&
+             (strcmp(input_buffer->buffer, ".vacuum") == 0 ||
+              strncmp(input_buffer->buffer, ".defrag", 7) == 0)) {
+    printf("Not supported by the lsm engine.\n");
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+    uint32_t old_num_pages = table->pager->num_pages;
+    uint32_t num_rows = vacuum_table(table);
+    printf("Vacuum: %d rows, %d pages (was %d).\n", num_rows,
+           table->pager->num_pages, old_num_pages);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".defrag", 7) == 0) {
+    return do_defrag_command(input_buffer, table);
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
-
+/* Parses "<keyword> id username email" into statement->row_to_insert */
+PrepareResult prepare_row(InputBuffer* input_buffer, Statement* statement) {
   char* keyword = strtok(input_buffer->buffer, " ");
   char* id_string = strtok(NULL, " ");
   char* username = strtok(NULL, " ");
@@ -633,25 +5475,99 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
   return PREPARE_SUCCESS;
 }
 
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+  return prepare_row(input_buffer, statement);
+}
+
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_UPDATE;
+  return prepare_row(input_buffer, statement);
+}
+
+/* Parses "select where <column> <comparison> <value>" */
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+  statement->where.active = false;
+  strtok(input_buffer->buffer, " ");
+  char* where = strtok(NULL, " ");
+  if (where == NULL) {
+    return PREPARE_SUCCESS;
+  }
+  char* column = strtok(NULL, " ");
+  char* comparison = strtok(NULL, " ");
+  char* value = strtok(NULL, "");
+  if (strcmp(where, "where") != 0 || column == NULL || comparison == NULL ||
+      value == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  Predicate* predicate = &statement->where;
+  predicate->active = true;
+  if (strcmp(column, "id") == 0) {
+    predicate->column = COLUMN_ID;
+  } else if (strcmp(column, "username") == 0) {
+    predicate->column = COLUMN_USERNAME;
+  } else if (strcmp(column, "email") == 0) {
+    predicate->column = COLUMN_EMAIL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(comparison, "=") == 0) {
+    predicate->comparison = COMPARE_EQUAL;
+  } else if (strcmp(comparison, "<") == 0) {
+    predicate->comparison = COMPARE_LESS;
+  } else if (strcmp(comparison, "<=") == 0) {
+    predicate->comparison = COMPARE_LESS_EQUAL;
+  } else if (strcmp(comparison, ">") == 0) {
+    predicate->comparison = COMPARE_GREATER;
+  } else if (strcmp(comparison, ">=") == 0) {
+    predicate->comparison = COMPARE_GREATER_EQUAL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (predicate->column == COLUMN_ID) {
+    int id = atoi(value);
+    if (id < 0) {
+      return PREPARE_NEGATIVE_ID;
+    }
+    predicate->id = id;
+    return PREPARE_SUCCESS;
+  }
+  /* Strings may be quoted, as in where email >= 'm' */
+  size_t length = strlen(value);
+  if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'') {
+    value++;
+    length -= 2;
+  }
+  size_t max_length = predicate->column == COLUMN_USERNAME
+                          ? COLUMN_USERNAME_SIZE
+                          : COLUMN_EMAIL_SIZE;
+  if (length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(predicate->text, value, length);
+  predicate->text[length] = '\0';
+  return PREPARE_SUCCESS;
+}
+
 PrepareResult prepare_statement(InputBuffer* input_buffer,
                                 Statement* statement) {
   if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
     return prepare_insert(input_buffer, statement);
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  if (strncmp(input_buffer->buffer, "update", 6) == 0) {
+    return prepare_update(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "select") == 0 ||
+      strncmp(input_buffer->buffer, "select ", 7) == 0) {
+    return prepare_select(input_buffer, statement);
   }
 
   return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
-/*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
-*/
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
-
 void create_new_root(Table* table, uint32_t right_child_page_num) {
   /*
   Handle splitting the root.
@@ -665,6 +5581,7 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
   void* right_child = get_page(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
   void* left_child = get_page(table->pager, left_child_page_num);
+  TRACE(new_root, left_child_page_num, right_child_page_num);
 
   if (get_node_type(root) == NODE_INTERNAL) {
     initialize_internal_node(right_child);
@@ -674,6 +5591,9 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
   /* Left child has data copied from old root */
   memcpy(left_child, root, PAGE_SIZE);
   set_node_root(left_child, false);
+  if (get_node_type(left_child) == NODE_LEAF) {
+    hash_index_put_leaf(table, left_child_page_num);
+  }
 
   if (get_node_type(left_child) == NODE_INTERNAL) {
     void* child;
@@ -689,7 +5609,7 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
   initialize_internal_node(root);
   set_node_root(root, true);
   *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
+  *internal_node_cell(root, 0) = left_child_page_num;
   uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
   *internal_node_key(root, 0) = left_child_max_key;
   *internal_node_right_child(root) = right_child_page_num;
@@ -700,6 +5620,21 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
 void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
                           uint32_t child_page_num);
 
+/* Index of the first buffered row with an id of at least key */
+uint32_t internal_node_find_message(void* node, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *internal_node_buffer_count(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (*internal_node_message_key(node, index) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
 void internal_node_insert(Table* table, uint32_t parent_page_num,
                           uint32_t child_page_num) {
   /*
@@ -738,7 +5673,7 @@ void internal_node_insert(Table* table, uint32_t parent_page_num,
 
   if (child_max_key > get_node_max_key(table->pager, right_child)) {
     /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_cell(parent, original_num_keys) = right_child_page_num;
     *internal_node_key(parent, original_num_keys) =
         get_node_max_key(table->pager, right_child);
     *internal_node_right_child(parent) = child_page_num;
@@ -764,11 +5699,14 @@ void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
   uint32_t old_page_num = parent_page_num;
   void* old_node = get_page(table->pager,parent_page_num);
   uint32_t old_max = get_node_max_key(table->pager, old_node);
+  uint32_t level = get_node_height(table->pager, old_node);
+  record_split(table, level);
 
   void* child = get_page(table->pager, child_page_num); 
   uint32_t child_max = get_node_max_key(table->pager, child);
 
   uint32_t new_page_num = get_unused_page_num(table->pager);
+  TRACE(internal_split, parent_page_num, new_page_num, level);
 
   /*
   Declaring a flag before updating pointers which
@@ -839,9 +5777,30 @@ void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
 
   update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
 
+  /* Buffered rows past the old node's new max belong to the new node */
+  uint32_t* buffer_count = internal_node_buffer_count(old_node);
+  uint32_t keep = internal_node_find_message(
+      old_node, get_node_max_key(table->pager, old_node));
+  if (keep < *buffer_count &&
+      *internal_node_message_key(old_node, keep) ==
+          get_node_max_key(table->pager, old_node)) {
+    keep++;
+  }
+  new_node = get_page(table->pager, new_page_num);
+  memcpy(internal_node_message(new_node, 0),
+         internal_node_message(old_node, keep),
+         (*buffer_count - keep) * BUFFER_MESSAGE_SIZE);
+  *internal_node_buffer_count(new_node) = *buffer_count - keep;
+  *buffer_count = keep;
+
   if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
+    /*
+    Point the new node at its parent before inserting it: if the parent
+    has to split as well, it may move the new node elsewhere and will fix
+    the pointer up itself
+    */
     *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table,*node_parent(old_node),new_page_num);
   }
 }
 
@@ -850,9 +5809,12 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 
   void* old_node = get_page(cursor->table->pager, cursor->page_num);
   uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
+  record_split(cursor->table, 0);
   uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  TRACE(leaf_split, cursor->page_num, new_page_num);
   void* new_node = get_page(cursor->table->pager, new_page_num);
   initialize_leaf_node(new_node);
+  leaf_node_set_layout(new_node, *leaf_node_layout(old_node));
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
   *leaf_node_next_leaf(old_node) = new_page_num;
@@ -865,22 +5827,25 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
       destination_node = old_node;
     }
     uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
 
     if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
+      leaf_node_set_row(destination_node, index_within_node, key, value);
     } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+      leaf_node_copy_cell(destination_node, index_within_node, old_node, i - 1);
     } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      leaf_node_copy_cell(destination_node, index_within_node, old_node, i);
     }
   }
 
   /* Update cell count on both leaf nodes */
   *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
   *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  leaf_node_zone_rebuild(old_node);
+
+  hash_index_put_leaf(cursor->table, new_page_num);
+  if (cursor->cell_num < LEAF_NODE_LEFT_SPLIT_COUNT) {
+    hash_index_put(cursor->table, key, cursor->page_num);
+  }
 
   if (is_node_root(old_node)) {
     return create_new_root(cursor->table, new_page_num);
@@ -908,19 +5873,205 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
   if (cursor->cell_num < num_cells) {
     // Make room for new cell
     for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+      leaf_node_copy_cell(node, i, node, i - 1);
     }
   }
 
   *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  leaf_node_set_row(node, cursor->cell_num, key, value);
+  hash_index_put(cursor->table, key, cursor->page_num);
+}
+
+/*
+B-epsilon engine. The tree is the same B+tree, but writes land in the root's
+buffer as rows. When a buffer fills, the rows headed for one child, the
+largest such batch, move a level down: into the child's buffer, or into the
+leaf itself if the child is one. A leaf then takes a batch of rows per write
+instead of one. Buffers nearer the root always hold the newer version of a
+row, so a lookup stops at the first one it finds on the way down.
+*/
+
+/* Buffers a serialized row, replacing an older one with the same id */
+void internal_node_buffer_put(void* node, uint32_t key, void* value) {
+  uint32_t count = *internal_node_buffer_count(node);
+  uint32_t index = internal_node_find_message(node, key);
+  if (index == count || *internal_node_message_key(node, index) != key) {
+    memmove(internal_node_message(node, index + 1),
+            internal_node_message(node, index),
+            (count - index) * BUFFER_MESSAGE_SIZE);
+    *internal_node_buffer_count(node) = count + 1;
+    *internal_node_message_key(node, index) = key;
+  }
+  memcpy(internal_node_message_value(node, index), value, ROW_SIZE);
+}
+
+/* Writes a row into its leaf, inserting or overwriting it */
+void betree_apply(Table* table, uint32_t key, void* value) {
+  Cursor* cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == key) {
+    leaf_node_set_value(node, cursor->cell_num, key, value);
+  } else {
+    Row row;
+    deserialize_row(value, &row);
+    leaf_node_insert(cursor, key, &row);
+  }
+  free(cursor);
+}
+
+/*
+Moves the largest batch of buffered rows for one child a level down. If the
+child's own buffer has no room for it, flushes the child instead; the caller
+checks again and calls back.
+*/
+void betree_flush_step(Table* table, uint32_t page_num) {
+  void* node = get_page(table->pager, page_num);
+  uint32_t count = *internal_node_buffer_count(node);
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  /* Rows are sorted, so each child's batch is a contiguous range */
+  uint32_t batch_start = 0;
+  uint32_t batch_end = 0;
+  uint32_t batch_child = 0;
+  uint32_t start = 0;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint32_t end = start;
+    while (end < count &&
+           (i == num_keys ||
+            *internal_node_message_key(node, end) <= *internal_node_key(node, i))) {
+      end++;
+    }
+    if (end - start > batch_end - batch_start) {
+      batch_start = start;
+      batch_end = end;
+      batch_child = i;
+    }
+    start = end;
+  }
+  uint32_t batch_size = batch_end - batch_start;
+  if (batch_size == 0) {
+    return;
+  }
+
+  uint32_t child_page_num = *internal_node_child(node, batch_child);
+  void* child = get_page(table->pager, child_page_num);
+  bool to_leaf = get_node_type(child) == NODE_LEAF;
+  if (!to_leaf && *internal_node_buffer_count(child) + batch_size >
+                      INTERNAL_NODE_BUFFER_MAX_MESSAGES) {
+    betree_flush_step(table, child_page_num);
+    return;
+  }
+
+  /* Take the batch out first: applying it to a leaf may split this node */
+  void* batch = malloc(batch_size * BUFFER_MESSAGE_SIZE);
+  memcpy(batch, internal_node_message(node, batch_start),
+         batch_size * BUFFER_MESSAGE_SIZE);
+  memmove(internal_node_message(node, batch_start),
+          internal_node_message(node, batch_end),
+          (count - batch_end) * BUFFER_MESSAGE_SIZE);
+  *internal_node_buffer_count(node) = count - batch_size;
+
+  for (uint32_t i = 0; i < batch_size; i++) {
+    void* message = batch + i * BUFFER_MESSAGE_SIZE;
+    uint32_t key = *(uint32_t*)message;
+    void* value = message + BUFFER_MESSAGE_KEY_SIZE;
+    if (to_leaf) {
+      betree_apply(table, key, value);
+    } else {
+      internal_node_buffer_put(child, key, value);
+    }
+  }
+  free(batch);
+
+  table->stats.buffer_flushes++;
+  if (to_leaf) {
+    table->stats.leaf_batches++;
+    table->stats.leaf_batch_rows += batch_size;
+  }
+}
+
+void betree_put(Table* table, uint32_t key, Row* row) {
+  void* root = get_page(table->pager, table->root_page_num);
+  if (get_node_type(root) == NODE_LEAF) {
+    Cursor* cursor = table_find(table, key);
+    void* node = get_page(table->pager, cursor->page_num);
+    if (cursor->cell_num < *leaf_node_num_cells(node) &&
+        *leaf_node_key(node, cursor->cell_num) == key) {
+      leaf_node_set_row(node, cursor->cell_num, key, row);
+    } else {
+      leaf_node_insert(cursor, key, row);
+    }
+    free(cursor);
+    return;
+  }
+  while (*internal_node_buffer_count(root) >= INTERNAL_NODE_BUFFER_MAX_MESSAGES) {
+    betree_flush_step(table, table->root_page_num);
+  }
+  uint8_t value[ROW_SIZE];
+  serialize_row(row, value);
+  internal_node_buffer_put(root, key, value);
+}
+
+/* The newest version of a row: the first buffer holding it, else its leaf */
+void* betree_get(Table* table, uint32_t key) {
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t index = internal_node_find_message(node, key);
+    if (index < *internal_node_buffer_count(node) &&
+        *internal_node_message_key(node, index) == key) {
+      return internal_node_message_value(node, index);
+    }
+    page_num = *internal_node_child(node, internal_node_find_child(node, key));
+    node = get_page(table->pager, page_num);
+  }
+  Cursor* cursor = leaf_node_find(table, page_num, key);
+  void* value = NULL;
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == key) {
+    value = leaf_node_row(node, cursor->cell_num, table->value_buffer);
+  }
+  free(cursor);
+  return value;
+}
+
+void betree_flush_all(Table* table) {
+  uint32_t page_num;
+  while ((page_num = betree_find_buffered(table->pager,
+                                          table->root_page_num)) !=
+         INVALID_PAGE_NUM) {
+    betree_flush_step(table, page_num);
+  }
 }
 
 ExecuteResult execute_insert(Statement* statement, Table* table) {
   Row* row_to_insert = &(statement->row_to_insert);
+  table->version++;
+  if (table->num_partitions > 0) {
+    return execute_insert(statement,
+                          table_partition(table, row_to_insert->id));
+  }
   uint32_t key_to_insert = row_to_insert->id;
+  if (table->lsm != NULL) {
+    if (lsm_get(table, key_to_insert) != NULL) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+    if (table->lsm->num_rows >= LSM_MAX_ROWS) {
+      return EXECUTE_TABLE_FULL;
+    }
+    lsm_put(table, key_to_insert, row_to_insert);
+    table->lsm->num_rows++;
+    return EXECUTE_SUCCESS;
+  }
+  if (table->betree) {
+    if (table_get(table, key_to_insert) != NULL) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+    betree_put(table, key_to_insert, row_to_insert);
+    table_bloom_add(table, key_to_insert);
+    return EXECUTE_SUCCESS;
+  }
   Cursor* cursor = table_find(table, key_to_insert);
 
   void* node = get_page(table->pager, cursor->page_num);
@@ -934,36 +6085,333 @@ ExecuteResult execute_insert(Statement* statement, Table* table) {
   }
 
   leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  table_bloom_add(table, row_to_insert->id);
 
   free(cursor);
 
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
+/* Tests the predicate's column, stored as serialize_row stores it */
+bool value_matches(Predicate* predicate, void* value) {
+  if (!predicate->active) {
+    return true;
+  }
+  int order;
+  if (predicate->column == COLUMN_ID) {
+    uint32_t id;
+    memcpy(&id, value, ID_SIZE);
+    order = id < predicate->id ? -1 : id > predicate->id;
+  } else {
+    order = strcmp(value, predicate->text);
+  }
+  switch (predicate->comparison) {
+    case COMPARE_EQUAL:
+      return order == 0;
+    case COMPARE_LESS:
+      return order < 0;
+    case COMPARE_LESS_EQUAL:
+      return order <= 0;
+    case COMPARE_GREATER:
+      return order > 0;
+    case COMPARE_GREATER_EQUAL:
+      return order >= 0;
+  }
+  return false;
+}
+
+/*
+Tests the rest of the cursor's leaf, leaving the cursor on its last cell.
+Values are compared in the page, so rows that don't match are never
+decoded, and on PAX leaves the values compared sit next to each other. On
+dictionary leaves each distinct string is compared once, and the rows
+only by their codes. Returns false once a row is past the upper bound.
+*/
+bool select_leaf(Cursor* cursor, Predicate* where, bool upper_bound,
+                 ResultBuffer* out) {
+  Table* table = cursor->table;
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (!leaf_node_may_match(node, where)) {
+    table->stats.leaves_skipped++;
+    cursor->cell_num = num_cells - 1;
+    return true;
+  }
+  Row row;
+  if (leaf_node_is_dict(node) && where->active &&
+      where->column != COLUMN_ID) {
+    uint32_t matching = 0;
+    uint32_t num_entries = *leaf_node_dict_num_entries(node, where->column);
+    for (uint32_t code = 0; code < num_entries; code++) {
+      if (value_matches(where,
+                        leaf_node_dict_entry(node, where->column, code))) {
+        matching |= 1u << code;
+      }
+    }
+    uint8_t* codes = leaf_node_dict_code(node, 0, where->column);
+    for (uint32_t cell = cursor->cell_num; cell < num_cells; cell++) {
+      table->stats.rows_scanned++;
+      if (matching >> codes[cell] & 1) {
+        deserialize_row(leaf_node_row(node, cell, table->value_buffer), &row);
+        print_row(out, &row);
+      }
+    }
+    cursor->cell_num = num_cells - 1;
+    return true;
+  }
+  void* value = leaf_node_column(node, cursor->cell_num, where->column);
+  uint32_t stride = leaf_node_column_stride(node, where->column);
+  for (uint32_t cell = cursor->cell_num; cell < num_cells;
+       cell++, value += stride) {
+    table->stats.rows_scanned++;
+    if (value_matches(where, value)) {
+      deserialize_row(leaf_node_row(node, cell, table->value_buffer), &row);
+      print_row(out, &row);
+    } else if (upper_bound) {
+      return false;
+    }
+  }
+  cursor->cell_num = num_cells - 1;
+  return true;
+}
+
+void select_rows(Predicate* where, Table* table, ResultBuffer* out);
+
+typedef struct {
+  Predicate* where;
+  Table* table;
+  ResultBuffer out;
+} PartitionScan;
+
+void* run_partition_scan(void* argument) {
+  PartitionScan* scan = argument;
+  select_rows(scan->where, scan->table, &scan->out);
+  return NULL;
+}
+
+/* Every line print_row writes starts with the row's id */
+uint32_t result_line_id(const char* line) { return strtoul(line + 1, NULL, 10); }
+
+/*
+Runs a select on every partition that may hold matches, a thread each, and
+joins the outputs in id order: range partitions just follow each other,
+hash partitions are merged line by line.
+*/
+void select_partitions(Predicate* where, Table* table, ResultBuffer* out) {
+  if (where->active && where->column == COLUMN_ID &&
+      where->comparison == COMPARE_EQUAL) {
+    select_rows(where, table_partition(table, where->id), out);
+    return;
+  }
+  PartitionScan scans[MAX_PARTITIONS];
+  pthread_t threads[MAX_PARTITIONS];
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    scans[i] = (PartitionScan){where, table->partitions[i], {NULL, 0, 0}};
+    if (partition_may_match(table, i, where)) {
+      pthread_create(&threads[i], NULL, run_partition_scan, &scans[i]);
+    }
+  }
+  size_t positions[MAX_PARTITIONS];
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    if (partition_may_match(table, i, where)) {
+      pthread_join(threads[i], NULL);
+    }
+    positions[i] = 0;
+  }
+
+  while (true) {
+    int32_t next = -1;
+    for (uint32_t i = 0; i < table->num_partitions; i++) {
+      if (positions[i] == scans[i].out.length) {
+        continue;
+      }
+      if (table->partition_scheme == PARTITION_RANGE) {
+        next = i;
+        break;
+      }
+      if (next == -1 ||
+          result_line_id(scans[i].out.data + positions[i]) <
+              result_line_id(scans[next].out.data + positions[next])) {
+        next = i;
+      }
+    }
+    if (next == -1) {
+      break;
+    }
+    ResultBuffer* source = &scans[next].out;
+    char* line = source->data + positions[next];
+    size_t length = source->length - positions[next];
+    if (table->partition_scheme == PARTITION_HASH) {
+      length = (char*)memchr(line, '\n', length) - line + 1;
+    }
+    result_buffer_append(out, line, length);
+    positions[next] += length;
+  }
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    free(scans[i].out.data);
+  }
+}
 
+/*
+Runs a select into out. Picks the access path: a point lookup for id
+equality (through the row cache, bloom filter and hash index, whichever are
+on); a seek for a lower bound on id, stopping past an upper one; otherwise a
+full scan that filters every row.
+*/
+void select_rows(Predicate* where, Table* table, ResultBuffer* out) {
+  if (table->num_partitions > 0) {
+    select_partitions(where, table, out);
+    return;
+  }
   Row row;
+  bool on_id = where->active && where->column == COLUMN_ID;
+  if (on_id && where->comparison == COMPARE_EQUAL) {
+    if (table_get_row(table, where->id, &row)) {
+      table->stats.rows_scanned++;
+      print_row(out, &row);
+    }
+    return;
+  }
+
+  Cursor* cursor;
+  if (on_id && where->comparison == COMPARE_GREATER_EQUAL) {
+    cursor = table_seek(table, where->id);
+  } else if (on_id && where->comparison == COMPARE_GREATER) {
+    cursor = table_seek(table, where->id + 1);
+  } else {
+    cursor = table_start(table);
+  }
+  bool upper_bound = on_id && (where->comparison == COMPARE_LESS ||
+                               where->comparison == COMPARE_LESS_EQUAL);
+
   while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
+    if (!cursor->lsm) {
+      if (!select_leaf(cursor, where, upper_bound, out)) {
+        break;
+      }
+    } else {
+      table->stats.rows_scanned++;
+      if (value_matches(where, cursor_column(cursor, where->column))) {
+        deserialize_row(cursor_value(cursor), &row);
+        print_row(out, &row);
+      } else if (upper_bound) {
+        break;
+      }
+    }
     cursor_advance(cursor);
   }
 
   free(cursor);
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  Predicate* where = &statement->where;
+  QueryCache* cache = table->query_cache;
+  if (cache != NULL) {
+    QueryCacheEntry* entry = query_cache_slot(cache, where);
+    if (entry->used && entry->version == table->version &&
+        predicate_equal(&entry->where, where)) {
+      cache->hits++;
+      fwrite(entry->result, 1, entry->length, stdout);
+      return EXECUTE_SUCCESS;
+    }
+    cache->misses++;
+  }
+
+  ResultBuffer out = {NULL, 0, 0};
+  select_rows(where, table, &out);
+  fwrite(out.data, 1, out.length, stdout);
+  if (cache != NULL) {
+    query_cache_put(table, where, &out);
+  } else {
+    free(out.data);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/* Overwrites the row in place; rows are fixed size so it never moves */
+ExecuteResult execute_update(Statement* statement, Table* table) {
+  Row* row_to_update = &(statement->row_to_insert);
+  table->version++;
+  if (table->num_partitions > 0) {
+    return execute_update(statement,
+                          table_partition(table, row_to_update->id));
+  }
+  if (table->row_cache != NULL) {
+    row_cache_invalidate(table->row_cache, row_to_update->id);
+  }
+  if (table->lsm != NULL) {
+    /* Runs are immutable, the new version goes in the memtable */
+    if (lsm_get(table, row_to_update->id) == NULL) {
+      return EXECUTE_KEY_NOT_FOUND;
+    }
+    lsm_put(table, row_to_update->id, row_to_update);
+    return EXECUTE_SUCCESS;
+  }
+  if (table->betree) {
+    if (table_get(table, row_to_update->id) == NULL) {
+      return EXECUTE_KEY_NOT_FOUND;
+    }
+    betree_put(table, row_to_update->id, row_to_update);
+    return EXECUTE_SUCCESS;
+  }
+  Cursor* cursor = table_find(table, row_to_update->id);
+
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (cursor->cell_num >= num_cells ||
+      *leaf_node_key(node, cursor->cell_num) != row_to_update->id) {
+    free(cursor);
+    return EXECUTE_KEY_NOT_FOUND;
+  }
+
+  leaf_node_set_row(node, cursor->cell_num, row_to_update->id, row_to_update);
+
+  free(cursor);
 
   return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_statement(Statement* statement, Table* table) {
+  if (statement->type != STATEMENT_SELECT && replication_is_follower(table)) {
+    return EXECUTE_READ_ONLY;
+  }
+  TRACE(statement_start, statement->type);
+  uint64_t start = monotonic_ns();
+  ExecuteResult result;
+  Histogram* latency;
   switch (statement->type) {
     case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
+      result = execute_insert(statement, table);
+      latency = &table->latency.insert;
+      break;
     case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+      result = execute_select(statement, table);
+      latency = &table->latency.select;
+      break;
+    case (STATEMENT_UPDATE):
+      result = execute_update(statement, table);
+      latency = &table->latency.update;
+      break;
+    default:
+      return EXECUTE_UNRECOGNIZED_STATEMENT;
+  }
+  table->stats.statements[statement->type]++;
+  histogram_record(latency, monotonic_ns() - start);
+  if (result == EXECUTE_SUCCESS && statement->type != STATEMENT_SELECT &&
+      table->replication != NULL) {
+    replication_append(table, statement->type, &statement->row_to_insert);
   }
+  TRACE(statement_done, statement->type, result);
+  return result;
 }
 
+/*
+Benchmarks and other harnesses #include this file directly to reach the
+engine internals; they define NOTTOSQL_NO_MAIN to supply their own main.
+*/
+#ifndef NOTTOSQL_NO_MAIN
 int main(int argc, char* argv[]) {
   if (argc < 2) {
     printf("Must supply a database filename.\n");
@@ -977,6 +6425,7 @@ int main(int argc, char* argv[]) {
   while (true) {
     print_prompt();
     read_input(input_buffer);
+    replication_poll(table);
 
     if (input_buffer->buffer[0] == '.') {
       switch (do_meta_command(input_buffer, table)) {
@@ -989,7 +6438,10 @@ int main(int argc, char* argv[]) {
     }
 
     Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
+    uint64_t prepare_start = monotonic_ns();
+    PrepareResult prepare_result = prepare_statement(input_buffer, &statement);
+    histogram_record(&table->latency.prepare, monotonic_ns() - prepare_start);
+    switch (prepare_result) {
       case (PREPARE_SUCCESS):
         break;
       case (PREPARE_NEGATIVE_ID):
@@ -1014,6 +6466,21 @@ int main(int argc, char* argv[]) {
       case (EXECUTE_DUPLICATE_KEY):
         printf("Error: Duplicate key.\n");
         break;
+      case (EXECUTE_KEY_NOT_FOUND):
+        printf("Error: Key not found.\n");
+        break;
+      case (EXECUTE_READ_ONLY):
+        printf("Error: Read-only replica.\n");
+        break;
+      case (EXECUTE_UNRECOGNIZED_STATEMENT):
+        printf("Error: Unrecognized statement.\n");
+        break;
+      case (EXECUTE_TABLE_FULL):
+        printf("Error: Table full.\n");
+        break;
     }
+    maybe_dump_latency(table);
+    backup_continue(table);
   }
 }
+#endif
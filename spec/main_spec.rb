@@ -1,11 +1,13 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-hot test.db-hash test.db-bloom test.db-log test.db.bak`
+    `rm -rf test.db-part*`
+    `rm -rf replica.db replica.db-hot`
   end
 
-  def run_script(commands)
+  def run_script(commands, filename = "test.db")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db #{filename}", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -450,9 +452,9 @@ describe 'database' do
       "db > Constants:",
       "ROW_SIZE: 293",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
+      "LEAF_NODE_HEADER_SIZE: 50",
       "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4034",
       "LEAF_NODE_MAX_CELLS: 13",
       "db > ",
     ])
@@ -487,4 +489,634 @@ describe 'database' do
       "db > ",
     ])
   end
+
+  # Test 14: Stats counters
+  it 'prints pager and tree stats' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result).to include(
+      "db > Stats:",
+      "pages_written: 0",
+      "splits_level_0: 1",
+      "tree_height: 2",
+      "leaf_nodes: 2",
+      "rows_scanned: 15",
+      "statements_insert: 15",
+      "statements_select: 1",
+    )
+  end
+
+  # Test 15: Latency histograms
+  it 'prints latency percentiles per statement type' do
+    script = (1..3).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".latency"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result).to include("db > Latency:")
+    expect(result.grep(/^insert: count=3 p50=\d+ns p99=\d+ns p999=\d+ns max=\d+ns$/).length).to eq(1)
+    expect(result.grep(/^select: count=1 /).length).to eq(1)
+    expect(result.grep(/^flush: count=0 /).length).to eq(1)
+  end
+
+  # Test 16: Update in place
+  it 'updates an existing row and rejects unknown ids' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "update 1 user1b person1b@example.com",
+      "update 2 user2 person2@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Key not found.",
+      "db > (1, user1b, person1b@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  # Test 17: Hot page list for cache warming
+  it 'saves the hot page list on close and reloads it on open' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    expect(File.exist?("test.db-hot")).to eq(true)
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result.length).to eq(32)
+    expect(result.last(2)).to match_array([
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  # Test 18: Header page is checked on open
+  it 'refuses to open a file without a valid header' do
+    File.write("test.db", "x" * 4096)
+    result = run_script([".exit"])
+    expect(result).to match_array([
+      "Db file is not a nottoSQL database.",
+    ])
+  end
+
+  # Test 19: Page checksums
+  it 'detects a corrupted page when it is read' do
+    run_script([
+      "insert 1 user1 person1@example.com",
+      ".exit",
+    ])
+    File.open("test.db", "r+b") do |file|
+      file.seek(4096 + 100)
+      file.write("corrupt")
+    end
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Page 1 checksum mismatch. Corrupt file.",
+    ])
+  end
+
+  # Test 20: Integrity check
+  it 'checks the tree and the page checksums on disk' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".check"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-2]).to eq("db > Check: 6 pages, 0 errors")
+
+    File.open("test.db", "r+b") do |file|
+      file.seek(4096 * 2 + 100)
+      file.write("corrupt")
+    end
+    result = run_script([
+      ".check",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Page 2: checksum mismatch",
+      "Check: 6 pages, 1 errors",
+      "db > ",
+    ])
+  end
+
+  # Test 21: Online and incremental backup
+  it 'backs up while rows are written, then copies only changed pages' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".backup test.db.bak"
+    script << "insert 31 user31 person31@example.com"
+    script << "update 1 user1b person1b@example.com"
+    script << ".backup test.db.bak"
+    script << ".backup wait"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-6]).to eq("db > Backing up to test.db.bak, all pages.")
+    expect(result[-3]).to eq("db > Backing up to test.db.bak, pages changed since LSN 3.")
+    expect(result[-2]).to eq("db > Backup to test.db.bak complete at LSN 5: 1 pages copied, 0 recopied, 4 unchanged.")
+
+    `mv test.db.bak test.db`
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result.length).to eq(33)
+    expect(result.first).to eq("db > (1, user1b, person1b@example.com)")
+
+    result = run_script([
+      "insert 32 user32 person32@example.com",
+      ".backup /nonexistent/test.db.bak",
+      ".exit",
+    ])
+    expect(result[1]).to eq("db > Error: Unable to open backup file /nonexistent/test.db.bak: No such file or directory")
+    result = run_script([
+      "select where id = 32",
+      ".exit",
+    ])
+    expect(result.first).to eq("db > (32, user32, person32@example.com)")
+  end
+
+  # Test 22: Defrag and vacuum
+  it 'puts leaves in key order and rebuilds the tree compactly' do
+    script = (1..30).map do |i|
+      key = (i * 7) % 31
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << ".defrag 100"
+    script << ".vacuum"
+    script << ".check"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(4)).to match_array([
+      "db > Defrag: moved 3 leaves, 0 out of place.",
+      "db > Vacuum: 30 rows, 5 pages (was 6).",
+      "db > Check: 5 pages, 0 errors",
+      "db > ",
+    ])
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result.length).to eq(32)
+    expect(result.first).to eq("db > (1, user1, person1@example.com)")
+    expect(result[29]).to eq("(30, user30, person30@example.com)")
+  end
+
+  # Test 23: LSM engine
+  it 'keeps rows sorted and durable with the lsm engine' do
+    script = [".engine lsm"]
+    script += (1..100).map do |i|
+      key = (i * 37) % 101
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << "update 42 answer answer@example.com"
+    script << "insert 42 dup dup@example.com"
+    script << ".engine btree"
+    script << ".vacuum"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Engine: lsm")
+    expect(result.last(5)).to match_array([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Error: Table is not empty.",
+      "db > Not supported by the lsm engine.",
+      "db > ",
+    ])
+
+    result = run_script([
+      ".engine",
+      "select",
+      ".check",
+      ".exit",
+    ])
+    expect(result.first).to eq("db > Engine: lsm")
+    expect(result[1]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[42]).to eq("(42, answer, answer@example.com)")
+    expect(result[100]).to eq("(100, user100, person100@example.com)")
+    expect(result[102]).to eq("db > Check: 12 pages, 0 errors")
+  end
+
+  # Test 24: B-epsilon engine
+  it 'buffers writes in internal nodes with the betree engine' do
+    script = [".engine betree"]
+    script += (1..60).map do |i|
+      key = (i * 37) % 61
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << "update 42 answer answer@example.com"
+    script << "insert 42 dup dup@example.com"
+    script << "update 99 nobody nobody@example.com"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Engine: betree")
+    expect(result[61..65]).to eq([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Error: Key not found.",
+      "db > Tree:",
+      "- internal (size 1)",
+    ])
+    expect(result[66]).to eq("  - buffer (size 9)")
+
+    result = run_script([
+      "select",
+      ".check",
+      ".btree",
+      ".exit",
+    ])
+    expect(result[0]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[41]).to eq("(42, answer, answer@example.com)")
+    expect(result[59]).to eq("(60, user60, person60@example.com)")
+    expect(result[61]).to eq("db > Check: 12 pages, 0 errors")
+    expect(result.none? { |line| line.include?("buffer") }).to eq(true)
+  end
+
+  # Test 25: Where clauses and the hash index
+  it 'filters selects and answers id lookups from the hash index' do
+    script = [".index hash"]
+    script += (1..40).map do |i|
+      key = (i * 17) % 41
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << "select where id = 23"
+    script << "select where id = 99"
+    script << "select where id > 38"
+    script << "select where username = user7"
+    script << "select where email <= 'person10@example.com'"
+    script << "select where name = x"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Index: hash, 0 keys, depth 0, 1 buckets")
+    expect(result.last(12)).to eq([
+      "db > (23, user23, person23@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > (39, user39, person39@example.com)",
+      "(40, user40, person40@example.com)",
+      "Executed.",
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > (10, user10, person10@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+
+    result = run_script([
+      ".index",
+      "select where id = 40",
+      ".stats",
+      ".index drop",
+      ".exit",
+    ])
+    expect(result[0]).to eq("db > Index: hash, 40 keys, depth 0, 1 buckets")
+    expect(result[1]).to eq("db > (40, user40, person40@example.com)")
+    expect(result).to include("index_lookups: 1")
+    expect(result[-2]).to eq("db > Index: none")
+  end
+
+  # Test 26: Bloom filter
+  it 'answers lookups for missing ids from the bloom filter' do
+    script = [".bloom on"]
+    script += (1..30).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    script += (1..30).map { |i| "select where id = #{i * 2 - 1}" }
+    script << "select where id = 8"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Bloom: 0 keys, 40 blocks, sized for 1024")
+    expect(result).to include("db > (8, user4, person4@example.com)")
+    expect(result).to include("bloom_negatives: 30")
+    expect(result).to include("bloom_false_positives: 0")
+
+    result = run_script([
+      ".bloom",
+      "insert 4 user2 person2@example.com",
+      ".bloom off",
+      ".bloom on",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Bloom: 30 keys, 40 blocks, sized for 1024",
+      "db > Error: Duplicate key.",
+      "db > Bloom: none",
+      "db > Bloom: 30 keys, 40 blocks, sized for 1024",
+      "db > ",
+    ])
+  end
+
+  # Test 27: Row cache
+  it 'serves repeated point selects from the row cache' do
+    script = [".rowcache 32"]
+    script += (1..10).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select where id = 3"
+    script << "select where id = 3"
+    script << "update 3 renamed3 renamed3@example.com"
+    script << "select where id = 3"
+    script << "select where id = 11"
+    script << ".rowcache"
+    script << ".stats"
+    script << ".rowcache off"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Row cache: 0 rows, capacity 32")
+    expect(result).to include(
+      "db > (3, user3, person3@example.com)",
+      "db > (3, renamed3, renamed3@example.com)",
+      "db > Row cache: 1 rows, capacity 32",
+      "row_cache_hits: 1",
+      "row_cache_misses: 3",
+      "row_cache_evictions: 0",
+    )
+    expect(result[-2]).to eq("db > Row cache: off")
+
+    script = [".rowcache 3"]
+    script += (1..10).map { |i| "select where id = #{i}" }
+    script << ".rowcache"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-2]).to eq("db > Row cache: 2 rows, capacity 3")
+  end
+
+  # Test 28: Query result cache
+  it 'replays cached select results until the table changes' do
+    script = [".querycache on"]
+    script += (1..5).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select where id > 3"
+    script << "select where email >= 'person4'"
+    script << "select  where  email >= person4"
+    script << ".querycache"
+    script << "update 4 user4 changed@example.com"
+    script << "select where id > 3"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first).to eq("db > Query cache: 0 results, 0 bytes")
+    expect(result).to include(
+      "db > Query cache: 2 results, 128 bytes",
+      "db > (4, user4, changed@example.com)",
+      "query_cache_hits: 1",
+      "query_cache_misses: 3",
+    )
+    expect(result.count("db > (4, user4, person4@example.com)")).to eq(3)
+  end
+
+  # Test 29: PAX leaf layout
+  it 'keeps the same rows after switching leaves to the pax layout' do
+    script = (1..30).map do |i|
+      key = (i * 7) % 31
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    before = run_script(script)
+
+    script = [".layout", ".layout pax", ".layout"]
+    script += (31..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "update 5 renamed5 renamed5@example.com"
+    script << "select where username = user38"
+    script << "select where id = 5"
+    script << ".check"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.first(3)).to eq([
+      "db > Layout: row",
+      "db > Layout: pax",
+      "db > Layout: pax",
+    ])
+    expect(result.last(6)).to eq([
+      "db > (38, user38, person38@example.com)",
+      "Executed.",
+      "db > (5, renamed5, renamed5@example.com)",
+      "Executed.",
+      "db > Check: 6 pages, 0 errors",
+      "db > ",
+    ])
+
+    result = run_script([".layout row", "select where id <= 30", ".exit"])
+    expect(result.first).to eq("db > Layout: row")
+    expect(result.drop(1)).to eq(before.drop(30).map do |line|
+      line.sub("(5, user5, person5@example.com)", "(5, renamed5, renamed5@example.com)")
+    end)
+  end
+
+  # Test 30: Zone maps
+  it 'skips leaves whose zone map rules out the predicate' do
+    script = (1..52).map do |i|
+      letter = ("a".ord + (i - 1) / 13).chr
+      "insert #{i} user#{i} #{letter}#{i}@example.com"
+    end
+    script << "select where email >= 'd'"
+    script << "select where email < 'a40'"
+    script << "update 2 user2 z2@example.com"
+    script << "select where email >= 'z'"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > (40, user40, d40@example.com)",
+      "db > (2, user2, z2@example.com)",
+    )
+    expect(result.count { |line| line.include?("@example.com)") }).to eq(13 + 7 + 1)
+    expect(result).to include("leaves_skipped: 16")
+  end
+
+  # Test 31: Dictionary encoded leaves
+  it 'filters dictionary encoded leaves by their codes' do
+    script = (1..40).map do |i|
+      "insert #{i} team#{i % 3} n#{i % 4}@example.com"
+    end
+    script << ".layout dict"
+    script += (1..20).map { |i| "update 1 team1 u#{i}@example.com" }
+    script << "select where email = n3@example.com"
+    script << "select where username > team1"
+    script << "select where email >= u2"
+    script << ".check"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > Layout: dict",
+      "db > (3, team0, n3@example.com)",
+      "db > (2, team2, n2@example.com)",
+      "db > (1, team1, u20@example.com)",
+      "db > Check: 6 pages, 0 errors",
+    )
+    expect(result.count { |line| line.include?("@example.com)") }).to eq(10 + 13 + 1)
+
+    result = run_script([".layout", "select where id = 39", ".exit"])
+    expect(result).to eq([
+      "db > Layout: dict",
+      "db > (39, team0, n3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  # Test 32: Log shipping replication
+  it 'replays the primary log on a read-only follower' do
+    script = (1..3).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".primary"
+    script << "insert 4 user4 person4@example.com"
+    script << "update 2 renamed2 renamed2@example.com"
+    script << ".replication"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > Replication: primary, lsn 5")
+
+    result = run_script([
+      ".follow test.db",
+      "select",
+      "insert 9 user9 person9@example.com",
+      ".stats",
+      ".follow off",
+      ".replication",
+      ".exit",
+    ], "replica.db")
+    expect(result).to include(
+      "db > (1, user1, person1@example.com)",
+      "(2, renamed2, renamed2@example.com)",
+      "(4, user4, person4@example.com)",
+      "db > Error: Read-only replica.",
+      "replication_lsn: 5",
+      "replication_lag_records: 0",
+      "db > Replication: off",
+    )
+
+    result = run_script([".replication", ".primary off", ".exit"])
+    expect(result).to eq([
+      "db > Replication: primary, lsn 5",
+      "db > Replication: off",
+      "db > ",
+    ])
+    expect(File.exist?("test.db-log")).to eq(false)
+  end
+
+  # Test 33: Partitioned tables
+  it 'spreads rows over partition files and merges scans in id order' do
+    script = [".partition hash 3"]
+    script += (1..30).map do |i|
+      key = (i * 7) % 31
+      "insert #{key} user#{key} person#{key}@example.com"
+    end
+    script << "insert 7 user7 person7@example.com"
+    script << "update 7 renamed7 renamed7@example.com"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > Error: Duplicate key.")
+
+    result = run_script([
+      "select where id = 7",
+      "select where username >= user28",
+      ".partition",
+      ".exit",
+    ])
+    expect(result.first(8)).to eq([
+      "db > (7, renamed7, renamed7@example.com)",
+      "Executed.",
+      "db > (3, user3, person3@example.com)",
+      "(4, user4, person4@example.com)",
+      "(5, user5, person5@example.com)",
+      "(6, user6, person6@example.com)",
+      "(8, user8, person8@example.com)",
+      "(9, user9, person9@example.com)",
+    ])
+    expect(result).to include("db > Partitions: 3 by hash")
+    counts = result.grep(/^- partition/).map { |line| line[/(\d+) rows/, 1].to_i }
+    expect(counts.sum).to eq(30)
+    expect(File.exist?("test.db-part2")).to eq(true)
+
+    `rm -rf test.db test.db-hot test.db-part*`
+    script = [".partition range 3 10"]
+    script += (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select where id > 18"
+    script << ".partition"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.count { |line| line.include?("@example.com)") }).to eq(12)
+    expect(result).to include(
+      "db > Partitions: 3 by range, 10 ids each",
+      "- partition 0: 9 rows, 2 pages",
+      "- partition 2: 11 rows, 2 pages",
+    )
+  end
+
+  # Test 34: Follower of a replaced primary log
+  it 'stops following once the primary starts a new log' do
+    run_script(["insert 1 user1 person1@example.com", ".primary", ".exit"])
+
+    raw_output = nil
+    IO.popen("./db replica.db", "r+") do |follower|
+      follower.puts ".follow test.db"
+      follower.flush
+      sleep 0.2
+
+      run_script([
+        ".primary off",
+        ".primary",
+        "insert 2 user2 person2@example.com",
+        "update 1 renamed1 renamed1@example.com",
+        ".exit",
+      ])
+
+      follower.puts ".replication"
+      follower.puts ".exit"
+      follower.close_write
+      raw_output = follower.gets(nil)
+    end
+    expect(raw_output.split("\n")).to include(
+      "db > Primary log was replaced or removed, stopped following.",
+      "Replication: off",
+    )
+  end
+
+  # Test 35: Full LSM table
+  it 'refuses lsm inserts past what one run holds and keeps the rows' do
+    script = [".engine lsm"]
+    script += (1..1665).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    result = run_script(script)
+    expect(result.count("db > Executed.")).to eq(1664)
+    expect(result[-2]).to eq("db > Error: Table full.")
+
+    result = run_script([
+      "select",
+      "insert 1666 user1666 person1666@example.com",
+      "update 1664 renamed renamed@example.com",
+      ".exit",
+    ])
+    expect(result.count { |line| line.include?("@example.com)") }).to eq(1664)
+    expect(result).to include(
+      "(1664, user1664, person1664@example.com)",
+      "db > Error: Table full.",
+      "db > Executed.",
+    )
+  end
 end